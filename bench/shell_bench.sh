@@ -0,0 +1,91 @@
+#!/bin/sh
+# Measures the throughput of the hot paths of the shell by piping generated scripts into it.
+#
+# Usage: sh bench/shell_bench.sh [shell] [results file]
+#        sh bench/shell_bench.sh --compare baseline.txt current.txt
+#
+# Every benchmark is run REPEAT times (3 by default) and the best run is kept. SCALE (1 by default)
+# multiplies the number of lines of every script. A results file has one line per benchmark:
+#   name lines seconds lines/sec
+
+if [ "$1" = "--compare" ]; then
+    if [ ! -f "$2" ] || [ ! -f "$3" ]; then
+        echo "Usage: $0 --compare baseline.txt current.txt" >&2
+        exit 1
+    fi
+    # A change of more than 5% either way is flagged
+    awk 'NR == FNR { base[$1] = $4; next }
+         { if (!($1 in base)) { printf "%-10s %14s %14.0f\n", $1, "-", $4; next }
+           change = ($4 - base[$1]) * 100 / base[$1]
+           flag = change < -5 ? "  slower" : (change > 5 ? "  faster" : "")
+           printf "%-10s %14.0f %14.0f %+8.1f%%%s\n", $1, base[$1], $4, change, flag }
+         BEGIN { printf "%-10s %14s %14s %9s\n", "benchmark", "baseline/s", "current/s", "change" }' "$2" "$3"
+    exit 0
+fi
+
+SHELL_BIN=${1:-./shell}
+RESULTS=${2:-bench/results/current.txt}
+REPEAT=${REPEAT:-3}
+SCALE=${SCALE:-1}
+if [ ! -x "$SHELL_BIN" ]; then
+    echo "No shell at $SHELL_BIN, run make first" >&2
+    exit 1
+fi
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+mkdir -p "$(dirname "$RESULTS")"
+: > "$RESULTS"
+
+# Assignments and $VAR expansion, every other line reads three variables back
+awk -v n=$((200000 * SCALE)) 'BEGIN {
+    for (i = 0; i < n; i++) {
+        if (i % 2 == 0) printf "V%d=value_number_%d\n", i % 512, i
+        else printf "X=$V%d-$V%d-$V%d\n", i % 512, (i * 7) % 512, (i * 13) % 512
+    }
+}' > "$WORK/assign.sh"
+
+# Long lines of quoted, escaped and plain words, run by the 'true' builtin so only parsing is measured
+awk -v n=$((20000 * SCALE)) 'BEGIN {
+    for (i = 0; i < n; i++) {
+        line = "true"
+        for (j = 0; j < 50; j++) line = line " \"double quoted " j "\" '\''single quoted'\'' plain" j " esc\\ aped"
+        print line
+    }
+}' > "$WORK/parse.sh"
+
+# Pipelines of 8 stages
+awk -v n=$((1000 * SCALE)) 'BEGIN {
+    for (i = 0; i < n; i++) print "echo line " i " | cat | cat | cat | cat | cat | cat | cat > /dev/null"
+}' > "$WORK/pipeline.sh"
+
+# Background jobs started and reaped, a 'wait' after every 100 of them
+awk -v n=$((5000 * SCALE)) 'BEGIN {
+    for (i = 1; i <= n; i++) {
+        print "sleep 0 &"
+        if (i % 100 == 0) print "wait"
+    }
+}' > "$WORK/jobs.sh"
+
+# A method to get the time in nanoseconds
+now_ns() {
+    date +%s%N
+}
+
+for name in assign parse pipeline jobs; do
+    script="$WORK/$name.sh"
+    lines=$(wc -l < "$script")
+    best=0
+    run=0
+    while [ $run -lt "$REPEAT" ]; do
+        start=$(now_ns)
+        "$SHELL_BIN" < "$script" > /dev/null 2>&1
+        end=$(now_ns)
+        elapsed=$((end - start))
+        if [ $best -eq 0 ] || [ $elapsed -lt $best ]; then
+            best=$elapsed
+        fi
+        run=$((run + 1))
+    done
+    awk -v name=$name -v lines=$lines -v ns=$best \
+        'BEGIN { printf "%s %d %.6f %.0f\n", name, lines, ns / 1e9, lines / (ns / 1e9) }' | tee -a "$RESULTS"
+done
@@ -0,0 +1,56 @@
+// Measures how long it takes to start and reap /bin/true with every spawn strategy of the shell
+// while the heap of the process grows.
+//
+// Build: make spawn_bench
+// Usage: ./spawn_bench [iterations] [heap size in MB]...
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../spawn.h"
+
+// A method to get the time in microseconds
+static double now_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 200;
+    static const int default_heaps[] = {0, 64, 256, 1024};
+    int heap_count = argc > 2 ? argc - 2 : (int)(sizeof(default_heaps) / sizeof(default_heaps[0]));
+    char *true_argv[] = {"/bin/true", NULL};
+    SpawnSpec spec = {true_argv, "/bin/true", STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, -1, -1, NULL};
+
+    printf("%-8s %-8s %10s %12s\n", "heap_mb", "strategy", "iterations", "avg_us");
+    for (int h = 0; h < heap_count; h++) {
+        size_t heap_mb = argc > 2 ? strtoul(argv[h + 2], NULL, 10) : (size_t)default_heaps[h];
+        char *heap = NULL;
+        if (heap_mb > 0) { // Touching every page so it is mapped when we spawn
+            heap = malloc(heap_mb << 20);
+            if (heap == NULL) {
+                printf("Could not allocate %zu MB\n", heap_mb);
+                return 1;
+            }
+            memset(heap, 1, heap_mb << 20);
+        }
+        for (int s = SPAWN_POSIX; s <= SPAWN_FORK; s++) {
+            double start = now_us();
+            for (int i = 0; i < iterations; i++) {
+                pid_t pid = spawn_process(s, &spec);
+                if (pid < 0) {
+                    perror("spawn_process");
+                    return 1;
+                }
+                waitpid(pid, NULL, 0);
+            }
+            printf("%-8zu %-8s %10d %12.1f\n", heap_mb, spawn_strategy_name(s), iterations, (now_us() - start) / iterations);
+        }
+        free(heap);
+    }
+    return 0;
+}
@@ -0,0 +1,114 @@
+// A client of 'shell --server': it sends command lines over the Unix socket of the server together with its
+// stdin, stdout and stderr, so the commands read and write them directly, and exits with the exit code of
+// the last line.
+//
+// Usage: client socket [command...]   runs the words of the command as one line
+//        client socket                runs every line of stdin
+//
+// A line with here-documents gets the reply '>' until the server has every line of their bodies.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define REPLY_MORE -2 // The server waits for more lines of the here-documents of the line
+
+// A method to send a line to the server and wait for its exit code, returns -1 if the server is gone and
+// REPLY_MORE if the line needs the lines after it
+int run_line(int fd, const char *line, size_t length){
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {(void *)line, length};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg -> cmsg_level = SOL_SOCKET;
+    cmsg -> cmsg_type = SCM_RIGHTS;
+    cmsg -> cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+        return -1;
+    }
+    char reply[16];
+    ssize_t n;
+    while ((n = recv(fd, reply, sizeof(reply) - 1, 0)) < 0 && errno == EINTR);
+    if (n <= 0) {
+        return -1;
+    }
+    reply[n] = '\0';
+    return reply[0] == '>' ? REPLY_MORE : atoi(reply);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("Usage: %s socket [command...]\n", argv[0]);
+        return 2;
+    }
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(argv[1]) >= sizeof(address.sun_path)) {
+        printf("The socket path %s is too long\n", argv[1]);
+        return 2;
+    }
+    strcpy(address.sun_path, argv[1]);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        printf("Error connecting to %s\n", argv[1]);
+        return 2;
+    }
+    int status = 0;
+    if (argc > 2) { // The words of the command make one line
+        size_t length = 0;
+        for (int i = 2; i < argc; i++) {
+            length += strlen(argv[i]) + 1;
+        }
+        char *line = malloc(length), *p = line;
+        if (line == NULL) {
+            printf("ERR\n");
+            return 2;
+        }
+        for (int i = 2; i < argc; i++) {
+            p = stpcpy(stpcpy(p, argv[i]), " ");
+        }
+        p[-1] = '\0';
+        status = run_line(fd, line, length - 1);
+        free(line);
+    } else { // Every line of stdin, the empty ones are skipped like in a script but not in a here-document
+        char *line = NULL;
+        size_t size = 0;
+        ssize_t length;
+        while (status != -1 && (length = getline(&line, &size, stdin)) >= 0) {
+            if (status == REPLY_MORE) { // A line of a body goes with its new line char, so an empty one is not lost
+                status = run_line(fd, line, length);
+                continue;
+            }
+            if (length > 0 && line[length - 1] == '\n') {
+                line[--length] = '\0';
+            }
+            if (length > 0) {
+                status = run_line(fd, line, length);
+            }
+        }
+        free(line);
+    }
+    close(fd);
+    if (status == REPLY_MORE) {
+        printf("The input ended inside a here-document\n");
+        return 2;
+    }
+    if (status < 0) {
+        printf("The server closed the connection\n");
+        return 2;
+    }
+    return status;
+}
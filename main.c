@@ -1,488 +1,5111 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
+#include <poll.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <stdint.h>
+#include <dirent.h>
+#include "spawn.h"
 
-#define MAX_LINE 510 //The max length of the command
-#define MAX_ARGS 10 //The max argument allowed
-pid_t GLOBAL_PID, background_pid;
+#define ARENA_BLOCK_SIZE 4096 // The size of a new arena block
+#define ARENA_KEEP_MAX (1 << 20) // The biggest block the arena keeps between lines
+#define READ_CHUNK (256 * 1024) // How much input is read at once
+#define COPY_CHUNK (64 * 1024) // How much is copied at once between fds, the output of a 'parallel' task, a fan-out or a memo entry
+#define PIPE_SIZE (1 << 20) // The size the pipes of a '|>' are grown to, the default limit of Linux
+#define GLOB_READ_CHUNK (64 * 1024) // How much of a directory a glob reads at once
+#define HISTORY_BATCH 32 // How many new lines of history are written and synced at once
+#define PROMPT_SIZE 1100 // Room for the prompt with a current directory of up to 1024 chars
+#define EDIT_MAX_COLUMNS 1024 // The widest terminal the line editor uses all of
+#define EDIT_REDRAW_SIZE (PROMPT_SIZE + 4 * EDIT_MAX_COLUMNS + 64) // A redraw of the prompt line always fits
+#define EDIT_NOTICE_DELAY_NS 20000000 // How long the notices of finished jobs are held back while a line is edited
+#define MEMO_MAX_SIZE (64LL << 20) // The default size limit of the cache of 'memo', $MEMO_MAX_SIZE changes it
+#define MEMO_MAGIC 0x31304f4d454d4853ULL // The last bytes of every entry of the cache of 'memo'
 
-// A struct for the environment variable
-typedef struct node{
-    char name[MAX_LINE]; // The name of the command
-    char value[MAX_LINE]; // The value of the command
-    struct node *next;
-}Node;
+// A slot of the variable table, the name and the value share one allocation "name\0value"
+typedef struct var_entry{
+    char *name; // NULL for an empty slot, VAR_TOMBSTONE for a deleted one
+    char *value; // Points into the same block as the name
+    size_t hash; // The cached hash of the name
+    size_t size; // The size of the block that holds the name and the value
+    int exported; // Set when the variable is passed to the environment of the children
+}VarEntry;
 
-// A method to find the node we are looking for
-Node *find_node(Node *head, char *name){
-    Node *current = head;
-    while(current != NULL){
-        if (strcmp(current -> name, name) == 0){ // Finding the correct command to use
-            return current;
+// An open addressing hash table for the environment variables
+typedef struct var_table{
+    VarEntry *slots;
+    size_t capacity; // Always a power of two
+    size_t count; // The number of live variables
+    size_t used; // The number of live variables and tombstones
+    int local; // Set when exporting only marks the variables, the environment of the process is left alone
+}VarTable;
+
+#define VAR_MIN_CAPACITY 16
+static char var_tombstone_marker;
+#define VAR_TOMBSTONE (&var_tombstone_marker)
+
+// A method to hash the name of a variable (FNV-1a)
+size_t var_hash(const char *name, size_t length){
+    size_t hash = (size_t)14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= (size_t)1099511628211ULL;
+    }
+    return hash;
+}
+
+// A method to find the slot of a name, returns the free slot to use if the name is not in the table
+VarEntry *var_find_slot(VarEntry *slots, size_t capacity, const char *name, size_t length, size_t hash){
+    size_t mask = capacity - 1;
+    size_t i = hash & mask;
+    VarEntry *free_slot = NULL;
+    while (1) {
+        VarEntry *slot = &slots[i];
+        if (slot -> name == NULL) { // End of the probe sequence, reusing a tombstone if we passed one
+            return free_slot != NULL ? free_slot : slot;
+        }
+        if (slot -> name == VAR_TOMBSTONE) {
+            if (free_slot == NULL) {
+                free_slot = slot;
+            }
+        } else if (slot -> hash == hash && strncmp(slot -> name, name, length) == 0 && slot -> name[length] == '\0') {
+            return slot;
         }
-        current = current -> next;
+        i = (i + 1) & mask; // Linear probing
     }
-    return NULL;
 }
 
-// A method to add a new node to the list
-Node *add_node(Node *head, char *name, char *value, int indicator){
-    // Checking to see if the name of the command is the same and changing the value
-    Node *found = find_node(head, name);
-    if(found != NULL && indicator == 1){
-        strcpy(found -> value, value);
+// A method to resize the table and drop the tombstones
+void var_resize(VarTable *table, size_t capacity){
+    VarEntry *slots = calloc(capacity, sizeof(VarEntry));
+    if (slots == NULL) {
+        printf("ERR\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < table -> capacity; i++) {
+        VarEntry *old = &table -> slots[i];
+        if (old -> name != NULL && old -> name != VAR_TOMBSTONE) {
+            *var_find_slot(slots, capacity, old -> name, strlen(old -> name), old -> hash) = *old;
+        }
+    }
+    free(table -> slots);
+    table -> slots = slots;
+    table -> capacity = capacity;
+    table -> used = table -> count;
+}
+
+// A method to get the value of a variable from a name that is not null terminated, NULL if it is not set
+const char *var_lookup(VarTable *table, const char *name, size_t length){
+    if (table -> count == 0) {
+        return NULL;
+    }
+    VarEntry *slot = var_find_slot(table -> slots, table -> capacity, name, length, var_hash(name, length));
+    if (slot -> name == NULL || slot -> name == VAR_TOMBSTONE) {
+        return NULL;
+    }
+    return slot -> value;
+}
+
+// A method to get the value of a variable, NULL if it is not set
+const char *var_get(VarTable *table, const char *name){
+    return var_lookup(table, name, strlen(name));
+}
+
+// A method to set a variable, adding it if it does not exist yet
+void var_set(VarTable *table, const char *name, const char *value){
+    if ((table -> used + 1) * 4 > table -> capacity * 3) { // Keeping the load factor under 3/4
+        size_t capacity = table -> capacity < VAR_MIN_CAPACITY ? VAR_MIN_CAPACITY : table -> capacity;
+        while ((table -> count + 1) * 2 > capacity) {
+            capacity *= 2;
+        }
+        var_resize(table, capacity);
     }
-    // Allocating new memory for the command that need to be saved
-    else {
-        Node *new_node = malloc(sizeof(Node));
-        if (new_node == NULL) {
+    size_t name_len = strlen(name), value_len = strlen(value);
+    size_t hash = var_hash(name, name_len);
+    VarEntry *slot = var_find_slot(table -> slots, table -> capacity, name, name_len, hash);
+    int is_new = slot -> name == NULL || slot -> name == VAR_TOMBSTONE;
+    size_t size = name_len + value_len + 2;
+    if (is_new || slot -> size < size) { // Growing the block only when the new value does not fit
+        char *block = realloc(is_new ? NULL : slot -> name, size);
+        if (block == NULL) {
             printf("ERR\n");
-            free(new_node);
             exit(1);
         }
-        strcpy(new_node -> name, name);
-        if(value != NULL) {
-            strcpy(new_node->value, value);
-        }
-        new_node -> next = NULL;
-        if (head == NULL) { // If the new node is the only node we point to it
-            head = new_node;
-        } else { // If we have more nodes in the list, we place the new node at the end
-            Node *current = head;
-            while (current -> next != NULL) {
-                current = current -> next;
-            }
-            current -> next = new_node;
-        }
-    }
-    return head;
-}
-
-Node *change_value(Node *head, char *name, char *old_value, char *new_value){
-    Node *found = find_node(head, name);
-    if(found != NULL){
-        char *value_change = found -> value;
-        char *new_value_change = value_change + 1;
-        if (strcmp(new_value_change, old_value) == 0) {
-            if (strlen(new_value) == 0) {
-                // If the whole value is equal to old_value and new_value is empty, delete the node
-                strcpy(found->value, "");
-                return head;
-            }
-            // If the whole value is equal to old_value and new_value is not empty, update the node value
-            strcpy(found -> value, new_value);
-            return head;
-        }
-        // Getting the position of the value we want to change
-        char *oldPos = strstr(value_change, old_value);
-        if (oldPos != NULL){
-            // Copy the part of the value before the old_value
-            char prefix[MAX_LINE];
-            strncpy(prefix, value_change, oldPos - value_change - 1);
-            prefix[oldPos - value_change] = '\0';
-
-            // Copy the part of the value after the old_value
-            char suffix[MAX_LINE];
-            strcpy(suffix, oldPos + strlen(old_value));
-
-            // Combining both
-            char newStr[MAX_LINE];
-            if (strlen(new_value) == 0) {
-                // If new_value is empty, delete the old_value and keep the rest of the string
-                strcpy(newStr, prefix);
-                strcat(newStr, suffix);
-            } else {
-                // If new_value is not empty, replace old_value with new_value
-                strcpy(newStr, prefix);
-                strcat(newStr, new_value);
-                strcat(newStr, suffix);
+        if (is_new) {
+            memcpy(block, name, name_len + 1);
+            if (slot -> name == NULL) {
+                table -> used++;
             }
+            table -> count++;
+            slot -> hash = hash;
+            slot -> exported = 0;
         }
+        slot -> name = block;
+        slot -> size = size;
+    }
+    slot -> value = slot -> name + name_len + 1;
+    memcpy(slot -> value, value, value_len + 1);
+    if (slot -> exported && !table -> local) {
+        setenv(name, value, 1);
     }
-    return head;
 }
 
-void signal_handler(int signum){
-    if (signum == SIGTSTP) { // Handling the ctrl z
-        if (GLOBAL_PID > 0 && GLOBAL_PID != background_pid) { // If there is a process we stop it
-            kill(GLOBAL_PID, SIGSTOP);
-        } else {
-        }
+// A method to remove a variable, returns 0 if it was not set
+int var_unset(VarTable *table, const char *name){
+    if (table -> count == 0) {
+        return 0;
     }
-    else if (signum == SIGCHLD) { // Handling the child process
-        // Checking the state of the process we should return immediately if the child process has not yet changed state
-        waitpid(GLOBAL_PID, NULL, WNOHANG);
+    size_t length = strlen(name);
+    VarEntry *slot = var_find_slot(table -> slots, table -> capacity, name, length, var_hash(name, length));
+    if (slot -> name == NULL || slot -> name == VAR_TOMBSTONE) {
+        return 0;
     }
+    if (slot -> exported && !table -> local) {
+        unsetenv(name);
+    }
+    free(slot -> name);
+    slot -> name = VAR_TOMBSTONE;
+    slot -> value = NULL;
+    table -> count--;
+    return 1;
 }
 
-// A method to print the prompt to the screen
-void print_prompt(int command_count, int arg_count){
-    char cwd[1024];
-    if(getcwd(cwd, sizeof(cwd)) == NULL){ // Checking to see if the buffer is enough
-        printf("Error with 'getcwd()' function\n");
-        exit(1);
+// A method to mark a variable as exported so the children get it in their environment
+int var_export(VarTable *table, const char *name){
+    if (table -> count == 0) {
+        return 0;
+    }
+    size_t length = strlen(name);
+    VarEntry *slot = var_find_slot(table -> slots, table -> capacity, name, length, var_hash(name, length));
+    if (slot -> name == NULL || slot -> name == VAR_TOMBSTONE) {
+        return 0;
     }
-    printf("#cmd:%d|#args:%d @%s> ", command_count, arg_count, cwd);
+    slot -> exported = 1;
+    if (!table -> local) {
+        setenv(slot -> name, slot -> value, 1);
+    }
+    return 1;
 }
 
-// A method to remove the quotes from the echo command
-char* removeQuotationMarks(const char* input, int* wordCount) {
-    size_t len = strlen(input);
-    char* result = (char*)malloc((len + 1)*sizeof(char)); // Allocating memory for the result string
-    if (result == NULL) {
-        printf("Memory allocation failed.\n");
-        exit(1);
+// A method to release the memory of the variable table
+void var_free(VarTable *table){
+    for (size_t i = 0; i < table -> capacity; i++) {
+        if (table -> slots[i].name != NULL && table -> slots[i].name != VAR_TOMBSTONE) {
+            free(table -> slots[i].name);
+        }
     }
-    size_t i, j = 0;
-    int count = 0, inQuotes = 0, pass = 0;
-    for (i = 0; i < len; i++) {
-        if (input[i] == '"') { // Checking if we are in quotes
-            inQuotes = !inQuotes;
-            pass++;
-            if (pass > 1 && pass % 2 == 0){ // Counting the word inside the quotes
-                count++;
-            }
-        } else if (input[i] == ' ' && !inQuotes && pass > 1 && pass % 2 == 0) { // If we are not in quotes we count the word
-            count++;
+    free(table -> slots);
+    table -> slots = NULL;
+    table -> capacity = table -> count = table -> used = 0; // A local table stays local
+}
+
+// A block of memory of the arena
+typedef struct arena_block{
+    struct arena_block *next; // The block that was filled before this one
+    size_t size; // The size of the data
+    size_t used; // The number of bytes already handed out
+    char data[];
+}ArenaBlock;
+
+// A bump allocator for everything that lives as long as one command line, it is released at once by arena_reset
+typedef struct arena{
+    ArenaBlock *head; // The block we allocate from
+    void *last; // The last allocation, so it can be grown in place
+    size_t total; // The number of bytes handed out since the last reset
+}Arena;
+
+#define ARENA_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+// A method to allocate memory from the arena
+void *arena_alloc(Arena *arena, size_t size){
+    size = ARENA_ALIGN(size);
+    ArenaBlock *block = arena -> head;
+    if (block == NULL || block -> size - block -> used < size) { // Starting a new block when the current one is full
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ArenaBlock) + block_size);
+        if (block == NULL) {
+            printf("ERR\n");
+            exit(1);
         }
+        block -> size = block_size;
+        block -> used = 0;
+        block -> next = arena -> head;
+        arena -> head = block;
+    }
+    void *ptr = block -> data + block -> used;
+    block -> used += size;
+    arena -> total += size;
+    arena -> last = ptr;
+    return ptr;
+}
+
+// A method to grow an allocation of the arena, the last allocation is extended in place when the block has room
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size){
+    old_size = ARENA_ALIGN(old_size);
+    new_size = ARENA_ALIGN(new_size);
+    ArenaBlock *block = arena -> head;
+    if (ptr != NULL && ptr == arena -> last && block -> size - (block -> used - old_size) >= new_size) {
+        block -> used += new_size - old_size;
+        arena -> total += new_size - old_size;
+        return ptr;
+    }
+    void *grown = arena_alloc(arena, new_size);
+    if (old_size > 0) {
+        memcpy(grown, ptr, old_size);
+    }
+    return grown;
+}
+
+// A method to make room for one more element in an array of the arena, doubling its capacity when it is full
+void *arena_reserve(Arena *arena, void *array, int count, int *capacity, size_t elem_size){
+    if (count < *capacity) {
+        return array;
+    }
+    int new_capacity = *capacity == 0 ? 4 : *capacity * 2;
+    array = arena_grow(arena, array, *capacity * elem_size, new_capacity * elem_size);
+    *capacity = new_capacity;
+    return array;
+}
+
+// A method to copy a string into the arena
+char *arena_strndup(Arena *arena, const char *str, size_t length){
+    char *copy = arena_alloc(arena, length + 1);
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    return copy;
+}
 
-        if (!inQuotes) { // We change the string
-            result[j] = input[i];
-            j++;
+// A method to release all the blocks of the arena
+void arena_free(Arena *arena){
+    ArenaBlock *block = arena -> head;
+    while (block != NULL) {
+        ArenaBlock *next = block -> next;
+        free(block);
+        block = next;
+    }
+    arena -> head = NULL;
+    arena -> last = NULL;
+    arena -> total = 0;
+}
+
+// A method to release everything allocated for the last line, keeping one block big enough for a line like it
+void arena_reset(Arena *arena){
+    ArenaBlock *block = arena -> head;
+    if (block == NULL) {
+        return;
+    }
+    if (block -> next != NULL || block -> size > ARENA_KEEP_MAX) { // The line needed more than one block
+        size_t size = arena -> total;
+        if (size < ARENA_BLOCK_SIZE) {
+            size = ARENA_BLOCK_SIZE;
+        } else if (size > ARENA_KEEP_MAX) {
+            size = ARENA_KEEP_MAX;
         }
-        if (inQuotes) { // Changing the state of inQuotes to need miss chars
-            inQuotes = !inQuotes;
+        arena_free(arena);
+        block = malloc(sizeof(ArenaBlock) + size);
+        if (block == NULL) {
+            printf("ERR\n");
+            exit(1);
         }
+        block -> size = size;
+        block -> next = NULL;
+        arena -> head = block;
     }
-    count++; // Adding the last word
-    *wordCount = count;
-    result[j] = '\0'; // Null terminate the end of the result string
-    return result;
+    block -> used = 0;
+    arena -> last = NULL;
+    arena -> total = 0;
 }
 
-// A method to remove leading spaces
-void removeLeadingSpaces(char* str) {
-    size_t len = strlen(str);
-    size_t leadingSpaces = strspn(str, " ");
+// A string that grows in the arena, it is always null terminated
+typedef struct str_buf{
+    Arena *arena;
+    char *data;
+    size_t length;
+    size_t capacity; // The room for chars, not counting the null terminator
+}StrBuf;
+
+// A method to start an empty string in the arena
+void strbuf_init(StrBuf *buf, Arena *arena, size_t capacity){
+    buf -> arena = arena;
+    buf -> data = arena_alloc(arena, capacity + 1);
+    buf -> data[0] = '\0';
+    buf -> length = 0;
+    buf -> capacity = capacity;
+}
 
-    if (leadingSpaces > 0) { // Adjust the pointer to remove leading spaces
-        memmove(str, str + leadingSpaces, len - leadingSpaces + 1);
+// A method to make room for more chars, doubling the capacity so appending stays linear
+void strbuf_reserve(StrBuf *buf, size_t extra){
+    if (buf -> length + extra <= buf -> capacity) {
+        return;
     }
+    size_t capacity = buf -> capacity * 2;
+    if (capacity < buf -> length + extra) {
+        capacity = buf -> length + extra;
+    }
+    buf -> data = arena_grow(buf -> arena, buf -> data, buf -> capacity + 1, capacity + 1);
+    buf -> capacity = capacity;
+}
+
+// A method to add chars to the end of the string
+void strbuf_append(StrBuf *buf, const char *str, size_t length){
+    strbuf_reserve(buf, length);
+    memcpy(buf -> data + buf -> length, str, length);
+    buf -> length += length;
+    buf -> data[buf -> length] = '\0';
 }
 
-// A method to release the memory for the linked list
-void free_list(Node *head){
-    Node *current = head;
-    while (current != NULL) {
-        Node *next = current->next;
-        free(current);
-        current = next;
+// A method to add formatted text to the end of the string
+void strbuf_printf(StrBuf *buf, const char *format, ...){
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buf -> data + buf -> length, buf -> capacity - buf -> length + 1, format, args);
+    va_end(args);
+    if (length < 0) {
+        return;
+    }
+    if ((size_t)length > buf -> capacity - buf -> length) { // It did not fit, formatting again with enough room
+        strbuf_reserve(buf, length);
+        va_start(args, format);
+        vsnprintf(buf -> data + buf -> length, length + 1, format, args);
+        va_end(args);
     }
-    free(current);
+    buf -> length += length;
 }
 
-int main(void) {
-    // Directing the signals to the correct location to be handled
-    signal(SIGTSTP, signal_handler);
-    signal(SIGCHLD, signal_handler);
+// The tokens of a command line
+enum token_type{
+    TOK_WORD, // A word, quotes included
+    TOK_PIPE, // '|'
+    TOK_AMP, // '&'
+    TOK_SEMI, // ';'
+    TOK_REDIRECT, // '>', '>>', '<', '<<' or '<<<', with the fd it applies to in front, like '2>'
+    TOK_FANOUT, // '|>'
+    TOK_END, // The end of the line
+    TOK_ERROR // A quote that is never closed
+};
 
-    char *args[MAX_ARGS + 1]; // Array for the command arguments
-    memset(args, 0, sizeof(args)); // Initialize the array to avoid garbage values
-    char command[MAX_LINE + 1]; // The command entered by the user
-    // The number of executed commands/arguments and an exit counter
-    int command_count = 0, arg_count = 0, exit_count = 0, output_file = 0;
-    Node *env_vars = NULL; // A linked list for the environment variables
-    Node *arguments = NULL; // A linked list for the arguments
+// What a redirect reads or writes
+enum redirect_kind{
+    REDIRECT_FILE, // The target is a file
+    REDIRECT_HERE_STRING, // '<<< word', the expanded word and a new line are the input
+    REDIRECT_HERE_DOC // '<< END', the input is the lines after the line of the command, up to a line 'END'
+};
 
-    while (1) {
-        char *result = NULL;
-        int numOfPipes = 0, is_pipe = 0, background = 0, pipe_id = 0, get_var = 0;
-        print_prompt(command_count, arg_count);
-        fgets(command, MAX_LINE + 1, stdin); // Reading the line of the command
-        // Checking if the command has a new line char and if we have reached the end of the input
-        if (strchr(command, '\n') == NULL && !feof(stdin)) {
-            printf("You've exceeded the maximum limit of %d\n", MAX_LINE);
-            int c;
-            while ((c = getchar()) != '\n' && c != EOF); // Delete the remaining characters in the input buffer
-            continue;
-        }
+// The body of a here-document, it is read once the whole line is parsed
+typedef struct here_doc{
+    char *delimiter; // Without its quotes
+    int raw; // Set when the delimiter had quotes or escapes, the body is then not expanded
+    char *body; // The lines with their new line chars, NULL until they are all read
+    StrBuf lines; // The lines read so far, the input may end before the delimiter and go on later
+    struct here_doc *next; // The next here-document of the line
+}HereDoc;
 
-        // Checking if the user has pressed enter three times
-        if (strcmp(command, "\n") == 0) {
-            exit_count++;
-            if (exit_count >= 3) {
-                free_list(env_vars); // Freeing the memory
-                free_list(arguments);
-                arguments = NULL;
-                if (result != NULL) {
-                    free(result);
+// The state of the lexer, the words point into the line
+typedef struct lexer{
+    const char *pos; // The next char to read
+    const char *word; // The start of the last word
+    size_t length; // The length of the last word
+    int redirect_fd; // The fd of the last redirect
+    int redirect_flags; // The open flags of the last redirect
+    int redirect_kind; // What the last redirect reads or writes
+    HereDoc *heredocs; // The here-documents of the line in the order their bodies follow it
+    HereDoc **heredoc_tail; // Where the next one is linked
+}Lexer;
+
+// A redirect of a command, the file is opened just before the command runs
+typedef struct redirect{
+    int fd; // The fd of the command that is redirected: 0, 1 or 2
+    int flags; // The flags the file is opened with
+    char *target; // The raw word of the file, of a here-string or the delimiter of a here-document
+    int kind; // A file, a here-string or a here-document
+    HereDoc *doc; // The body of a here-document
+}Redirect;
+
+// A command of a pipeline, the words are kept raw and expanded just before the command runs
+typedef struct command{
+    char **argv; // The raw words of the command, NULL terminated
+    int argc;
+    Redirect *redirects; // In the order they were given, the last one of an fd wins
+    int redirect_count;
+    char **fanout; // The raw words of the files after '|>', each gets a copy of the output
+    int fanout_count;
+    struct command_line *group; // The commands inside the '{ }' of 'parallel', NULL for other commands
+}Command;
+
+// Commands connected with '|'
+typedef struct pipeline{
+    Command *commands;
+    int count;
+    int background; // Set when the pipeline ends with '&'
+    int timed; // Set when the pipeline starts with 'time'
+}Pipeline;
+
+// All the pipelines of one line, separated by ';' or '&'
+typedef struct command_line{
+    Pipeline *pipelines;
+    int count;
+    HereDoc *heredocs; // The here-documents whose bodies follow the line
+}CommandLine;
+
+// A method to find the '}' that closes a '${', p is right after the '{'. Quotes, escapes and nested '${...}'
+// are skipped. Returns NULL if the brace is never closed.
+const char *find_brace_end(const char *p){
+    int depth = 1;
+    for (; *p != '\0'; p++) {
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+        } else if (*p == '"' || *p == '\'') {
+            char quote = *p++;
+            while (*p != quote) {
+                if (*p == '\0') {
+                    return NULL;
                 }
-                exit(0);
+                if (*p == '\\' && quote == '"' && p[1] != '\0') {
+                    p++;
+                }
+                p++;
             }
-            continue;
-        } else {
-            exit_count = 0;
+        } else if (*p == '$' && p[1] == '{') {
+            depth++;
+            p++;
+        } else if (*p == '}' && --depth == 0) {
+            return p;
         }
+    }
+    return NULL;
+}
 
-        // Splitting the input into multiple commands seperated by ';'
-        char *outer_savePtr, *inner_savePtr, *pipe_savePtr;
-        char name[MAX_LINE], value[MAX_LINE], arg_name[MAX_LINE];
-        char *cmd_token = strtok_r(command, ";", &outer_savePtr);
-        for (int i = 0; i < strlen(cmd_token); i++) { // Checking for pipes
-            if (cmd_token[i] == '|') {
-                numOfPipes++;
-                is_pipe = 1;
-            }
-        }
-        pid_t pid_array[numOfPipes + 1]; // An array so save the pid of the pipe childes
-        memset(args, 0, sizeof(args));
-        if (strstr(cmd_token, "&") != NULL) { // If we want to run a background task we check it here
-            background = 1;
-            // We remove the '&' from the command line
-            char *temp_command = strtok(cmd_token, "&");
-            strcpy(cmd_token, temp_command);
-        }
-        while (cmd_token != NULL) {
-            int counter = 0;
-            // Getting the name of the function and getting the value of that function
-            if (sscanf(cmd_token, "%[^=]=%[^\n]", name, value) == 2) {
-                // Checking to see that the user want to set environmental variable and not just print to the screen
-                if (strstr(name, "echo") == NULL) {
-                    char temp_value[MAX_LINE];
-                    char temp_name[MAX_LINE];
-                    int j = 0, k = 0;
-                    for (int p = 0; p < strlen(name); p++) { // Deleting the spaces from the name if it has any
-                        if (name[p] != ' ') {
-                            temp_name[k] = name[p];
-                            k++;
-                        }
-                    }
-                    for (int p = 0; p < strlen(value); p++) { // Deleting the quotes from the value if it has any
-                        if (value[p] != '"') {
-                            temp_value[j] = value[p];
-                            j++;
-                        }
-                    }
-                    temp_name[k] = '\0'; // Ending the string
-                    temp_value[j] = '\0';
-                    env_vars = add_node(env_vars, temp_name, temp_value, 1); // Adding the function to the linked list
-                    // Skipping to the next command, so we won't count it
-                    cmd_token = strtok_r(NULL, ";", &outer_savePtr);
-                    continue;
-                }
-            }
+// A method to read the redirect operator at p, for the given fd or for the default fd of the operator when it is -1
+int lex_redirect(Lexer *lexer, const char *p, int fd){
+    lexer -> redirect_kind = REDIRECT_FILE;
+    if (*p == '<') {
+        int length = p[1] != '<' ? 1 : p[2] != '<' ? 2 : 3; // '<', '<<' or '<<<'
+        lexer -> redirect_fd = fd < 0 ? STDIN_FILENO : fd;
+        lexer -> redirect_flags = O_RDONLY;
+        lexer -> redirect_kind = length == 1 ? REDIRECT_FILE : length == 2 ? REDIRECT_HERE_DOC : REDIRECT_HERE_STRING;
+        lexer -> pos = p + length;
+    } else {
+        int append = p[1] == '>';
+        lexer -> redirect_fd = fd < 0 ? STDOUT_FILENO : fd;
+        lexer -> redirect_flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
+        lexer -> pos = p + 1 + append;
+    }
+    return TOK_REDIRECT;
+}
 
-            // Recording the arguments
-            else {
-                char *pipe_token = strtok_r(cmd_token, "|", &pipe_savePtr); // Splitting the pipes
-                removeLeadingSpaces(pipe_token);
-                if(strstr(pipe_token, "$") != NULL){ // An indicator for env_vars
-                    get_var = 1;
+// A method to read the next token of the line
+int next_token(Lexer *lexer){
+    const char *p = lexer -> pos;
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+        p++;
+    }
+    lexer -> pos = p + 1;
+    switch (*p) {
+        case '\0':
+            lexer -> pos = p;
+            return TOK_END;
+        case '|':
+            if (p[1] == '>') {
+                lexer -> pos = p + 2;
+                return TOK_FANOUT;
+            }
+            return TOK_PIPE;
+        case '&':
+            return TOK_AMP;
+        case ';':
+            return TOK_SEMI;
+        case '>':
+        case '<':
+            return lex_redirect(lexer, p, -1);
+    }
+    if (*p >= '0' && *p <= '2' && (p[1] == '>' || p[1] == '<')) { // The fd of a redirect, like '2>'
+        return lex_redirect(lexer, p + 1, *p - '0');
+    }
+    const char *start = p;
+    while (*p != '\0' && strchr(" \t\n\r|&;<>", *p) == NULL) {
+        if (*p == '"' || *p == '\'') { // Skipping to the closing quote, the special chars inside are part of the word
+            char quote = *p++;
+            while (*p != quote) {
+                if (*p == '\0') {
+                    lexer -> pos = p;
+                    return TOK_ERROR;
                 }
-                while (pipe_token != NULL) {
-                    // Getting the command at one side and the args at the other
-                    if (sscanf(pipe_token, "%[^ ] %[^\n]", arg_name, value) == 2) {
-                        int num_of_quotes = 0;
-                        for (int j = 0; j < strlen(value); j++) { // Checking to see if the args are in quotes
-                            if (value[j] == '"'){
-                                num_of_quotes++;
-                            }
-                        }
-                        if (num_of_quotes > 1 && num_of_quotes % 2 == 0){ // Removing quotes
-                            result = removeQuotationMarks(value, &counter);
-                            arguments = add_node(arguments, arg_name, result, 0);
-                        }
-                        else{ // If we don't have quotes
-                            char *arg_token = strtok_r(pipe_token, " \n", &inner_savePtr); // Getting the next argument
-                            while (arg_token != NULL){ // Counting the args
-                                counter++;
-                                arg_token = strtok_r(NULL, " \n", &inner_savePtr); // Getting the next argument
-                            }
-                            arguments = add_node(arguments, arg_name, value, 0);
-                        }
-                    }
-                    else{ // If we have a command with just one word we go here
-                        char *arg_token = strtok_r(pipe_token, " \n", &inner_savePtr);
-                        while (arg_token != NULL){
-                            counter++;
-                            arguments = add_node(arguments, arg_token, NULL, 0);
-                            arg_token = strtok_r(NULL, " \n", &inner_savePtr);
-                        }
-                    }
-                    pipe_token = strtok_r(NULL, "|", &pipe_savePtr); // Getting the next command/pipe
-                    if (pipe_token != NULL) {
-                        removeLeadingSpaces(pipe_token);
-                    }
+                if (*p == '\\' && quote == '"' && p[1] != '\0') {
+                    p++;
+                } else if (*p == '$' && p[1] == '{' && quote == '"' && (p = find_brace_end(p + 2)) == NULL) {
+                    lexer -> pos = start + strlen(start);
+                    return TOK_ERROR;
                 }
+                p++;
             }
-
-            if (get_var == 1) {
-                char *arg; // A variable to see all the string
-                char *var_token, *sign_check, *inner, *outer;
-                Node *to_be_changed; // A variable to copy the value too
-                arg = (char *) (Node *) find_node(arguments, arg_name)->value; // Getting the string
-                if (strstr(arg, "$") != NULL) { // Checking for '$' sign
-                    sign_check = strtok_r(arg, " \n", &inner);
-                    var_token = strtok_r(sign_check, "$", &outer);
-                    while (var_token != NULL && strcmp(var_token, " ") != 0) {
-                        to_be_changed = find_node(env_vars, var_token); // Getting the value we want
-                        if (to_be_changed != NULL) { // Changing the value
-                            change_value(arguments, arg_name, var_token, to_be_changed->value);
-                        }
-                            // If there is not such variable we delete the unused variable
-                        else if (strstr(sign_check, "$") != NULL && to_be_changed == NULL) {
-                            change_value(arguments, arg_name, var_token, "");
-                        }
-                        sign_check = strtok_r(NULL, " \n", &inner);
-                        var_token = strtok_r(sign_check, "$", &outer);
-                    }
-                }
+        } else if (*p == '\\' && p[1] != '\0') { // An escaped char is part of the word
+            p++;
+        } else if (*p == '$' && p[1] == '{') { // A '${...}' is part of the word even if it has spaces or special chars
+            p = find_brace_end(p + 2);
+            if (p == NULL) {
+                lexer -> pos = start + strlen(start);
+                return TOK_ERROR;
             }
+        }
+        p++;
+    }
+    lexer -> word = start;
+    lexer -> length = p - start;
+    lexer -> pos = p;
+    return TOK_WORD;
+}
+
+// A method to check if the last word of the lexer is a given single char
+int word_is(Lexer *lexer, char c){
+    return lexer -> length == 1 && lexer -> word[0] == c;
+}
 
-            if (counter > MAX_ARGS) { // If the max argument has been passed we skip the command and go to  the next one
-                printf("Too many arguments, max allowed is: %d\n", MAX_ARGS);
-                arguments -> value[0] = '\0';
-                free_list(arguments);
-                arguments = NULL;
-                cmd_token = strtok_r(NULL, ";", &outer_savePtr);
+// A method to add a here-document to the line, its delimiter is the word after '<<' without its quotes and escapes
+HereDoc *here_doc_add(Arena *arena, Lexer *lexer, const char *word, size_t length){
+    HereDoc *doc = arena_alloc(arena, sizeof(HereDoc));
+    doc -> delimiter = arena_alloc(arena, length + 1);
+    doc -> raw = 0;
+    doc -> body = NULL;
+    doc -> lines.data = NULL;
+    doc -> next = NULL;
+    size_t n = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (word[i] == '"' || word[i] == '\'' || word[i] == '\\') {
+            doc -> raw = 1;
+            if (word[i] != '\\' || ++i == length) {
                 continue;
             }
-            if (find_node(arguments, "bg") != NULL) { // If we get 'bg' we make the process run in the background
-                kill(GLOBAL_PID, SIGCONT);
-                printf("Process has resumed in the background\n");
-                arguments -> value[0] = '\0';
-                free_list(arguments);
-                arguments = NULL;
-                cmd_token = strtok_r(NULL, ";", &outer_savePtr);
+        }
+        doc -> delimiter[n++] = word[i];
+    }
+    doc -> delimiter[n] = '\0';
+    *lexer -> heredoc_tail = doc;
+    lexer -> heredoc_tail = &doc -> next;
+    return doc;
+}
+
+// A method to parse pipelines until the end of the line, or until the '}' that closes a group when nested.
+// Returns 0 on a syntax error.
+int parse_list(Arena *arena, Lexer *lexer, CommandLine *cmd_line, int nested){
+    Command command = {NULL, 0, NULL, 0, NULL, 0, NULL};
+    Pipeline pipeline = {NULL, 0, 0, 0};
+    int argv_capacity = 0, redirects_capacity = 0, fanout_capacity = 0, commands_capacity = 0, pipelines_capacity = 0;
+    int token, closed = 0, fanout = 0; // fanout is set while reading the files after '|>'
+    cmd_line -> pipelines = NULL;
+    cmd_line -> count = 0;
+    do {
+        token = next_token(lexer);
+        if (token == TOK_ERROR || (token == TOK_END && nested)) { // A quote or a group that is never closed
+            return 0;
+        }
+        if (token == TOK_WORD && nested && command.group == NULL && word_is(lexer, '}')) {
+            closed = 1; // The group ends like a line does, a quoted '}' is a plain word
+            token = TOK_END;
+        } else if (token == TOK_WORD && pipeline.count == 0 && command.argc == 0 && !pipeline.timed &&
+                   lexer -> length == 4 && strncmp(lexer -> word, "time", 4) == 0) {
+            pipeline.timed = 1; // 'time' is a prefix of the pipeline, not a command
+            continue;
+        } else if (token == TOK_WORD && command.group != NULL) {
+            return 0; // Nothing may follow the group of 'parallel'
+        } else if (token == TOK_WORD && command.argc > 0 && word_is(lexer, '{') && strcmp(command.argv[0], "parallel") == 0) {
+            command.group = arena_alloc(arena, sizeof(CommandLine));
+            if (!parse_list(arena, lexer, command.group, 1)) {
+                return 0;
+            }
+            continue;
+        } else if (token == TOK_WORD && fanout) {
+            command.fanout = arena_reserve(arena, command.fanout, command.fanout_count, &fanout_capacity, sizeof(char *));
+            command.fanout[command.fanout_count++] = arena_strndup(arena, lexer -> word, lexer -> length);
+            continue;
+        } else if (token == TOK_WORD) {
+            command.argv = arena_reserve(arena, command.argv, command.argc + 1, &argv_capacity, sizeof(char *));
+            command.argv[command.argc++] = arena_strndup(arena, lexer -> word, lexer -> length);
+            continue;
+        }
+        if (token == TOK_REDIRECT) { // The file must follow the operator
+            Redirect redirect = {lexer -> redirect_fd, lexer -> redirect_flags, NULL, lexer -> redirect_kind, NULL};
+            if (fanout || next_token(lexer) != TOK_WORD) {
+                return 0;
+            }
+            redirect.target = arena_strndup(arena, lexer -> word, lexer -> length);
+            if (redirect.kind == REDIRECT_HERE_DOC) {
+                redirect.doc = here_doc_add(arena, lexer, lexer -> word, lexer -> length);
+            }
+            command.redirects = arena_reserve(arena, command.redirects, command.redirect_count, &redirects_capacity, sizeof(Redirect));
+            command.redirects[command.redirect_count++] = redirect;
+            continue;
+        }
+        if (token == TOK_FANOUT) { // The words up to the end of the command are the files of the fan-out
+            if (command.argc == 0 || command.group != NULL || fanout) {
+                return 0;
+            }
+            fanout = 1;
+            continue;
+        }
+        // Every other token ends the command
+        if (fanout && command.fanout_count == 0) {
+            return 0; // '|>' without a file
+        }
+        if (command.group != NULL && (pipeline.count > 0 || token == TOK_PIPE)) {
+            return 0; // 'parallel' can not be a stage of a pipeline
+        }
+        if (command.argc > 0) {
+            command.argv[command.argc] = NULL;
+            pipeline.commands = arena_reserve(arena, pipeline.commands, pipeline.count, &commands_capacity, sizeof(Command));
+            pipeline.commands[pipeline.count++] = command;
+        } else if (command.redirect_count > 0 || (pipeline.count > 0 || token == TOK_PIPE)) {
+            return 0; // A redirect without a command, or a pipe with a missing side
+        }
+        command.argv = NULL;
+        command.argc = 0;
+        command.redirects = NULL;
+        command.redirect_count = 0;
+        command.fanout = NULL;
+        command.fanout_count = 0;
+        command.group = NULL;
+        argv_capacity = redirects_capacity = fanout_capacity = 0;
+        fanout = 0;
+        if (token == TOK_PIPE) {
+            continue;
+        }
+        // '&', ';' and the end of the line end the pipeline
+        if (pipeline.count > 0) {
+            pipeline.background = token == TOK_AMP;
+            cmd_line -> pipelines = arena_reserve(arena, cmd_line -> pipelines, cmd_line -> count, &pipelines_capacity, sizeof(Pipeline));
+            cmd_line -> pipelines[cmd_line -> count++] = pipeline;
+        }
+        pipeline.commands = NULL;
+        pipeline.count = 0;
+        pipeline.timed = 0;
+        commands_capacity = 0;
+    } while (token != TOK_END);
+    return !nested || closed;
+}
+
+// A method to parse a line into pipelines of commands in one pass, returns NULL on a syntax error. The bodies of
+// the here-documents of the line are read after it with read_heredocs.
+CommandLine *parse_line(Arena *arena, const char *line){
+    Lexer lexer = {line, NULL, 0, -1, 0, REDIRECT_FILE, NULL, NULL};
+    lexer.heredoc_tail = &lexer.heredocs;
+    CommandLine *cmd_line = arena_alloc(arena, sizeof(CommandLine));
+    if (!parse_list(arena, &lexer, cmd_line, 0)) {
+        return NULL;
+    }
+    cmd_line -> heredocs = lexer.heredocs;
+    return cmd_line;
+}
+
+// A method to check if a raw word is a 'name=value' assignment, returns the length of the name or 0
+size_t assignment_name_length(const char *word){
+    if (!isalpha((unsigned char)word[0]) && word[0] != '_') {
+        return 0;
+    }
+    size_t i = 1;
+    while (isalnum((unsigned char)word[i]) || word[i] == '_') {
+        i++;
+    }
+    return word[i] == '=' ? i : 0;
+}
+
+// Reads the input in big chunks and hands it out line by line, there is no limit on the length of a line
+typedef struct line_reader{
+    int fd;
+    char *buf;
+    size_t size; // The allocated size of the buffer
+    size_t start; // The start of the next line
+    size_t scanned; // Everything before this was already searched for a new line char
+    size_t end; // The end of the data read so far
+    int eof;
+    int wake_fd; // An fd polled next to the input, -1 for none
+    void (*on_wake)(void *ctx); // Called when wake_fd is readable while we wait for input
+    void *ctx;
+}LineReader;
+
+// A method to start reading an fd
+void reader_init(LineReader *reader, int fd){
+    reader -> fd = fd;
+    reader -> size = READ_CHUNK;
+    reader -> buf = malloc(reader -> size);
+    if (reader -> buf == NULL) {
+        printf("ERR\n");
+        exit(1);
+    }
+    reader -> start = reader -> scanned = reader -> end = 0;
+    reader -> eof = 0;
+    reader -> wake_fd = -1;
+}
+
+// A method to get the next line without its new line char, NULL at the end of the input.
+// The line stays valid until the next call.
+char *read_line(LineReader *reader){
+    while (1) {
+        char *newline = memchr(reader -> buf + reader -> scanned, '\n', reader -> end - reader -> scanned);
+        if (newline != NULL) {
+            char *line = reader -> buf + reader -> start;
+            *newline = '\0';
+            reader -> start = reader -> scanned = newline - reader -> buf + 1;
+            return line;
+        }
+        reader -> scanned = reader -> end;
+        if (reader -> eof) {
+            if (reader -> start == reader -> end) {
+                return NULL;
+            }
+            char *line = reader -> buf + reader -> start; // The last line has no new line char
+            reader -> buf[reader -> end] = '\0';
+            reader -> start = reader -> scanned = reader -> end;
+            return line;
+        }
+        if (reader -> start > 0) { // Moving the unfinished line to the front to make room
+            memmove(reader -> buf, reader -> buf + reader -> start, reader -> end - reader -> start);
+            reader -> end -= reader -> start;
+            reader -> scanned -= reader -> start;
+            reader -> start = 0;
+        }
+        if (reader -> size - reader -> end < READ_CHUNK / 2) { // A long line, growing the buffer
+            reader -> size *= 2;
+            reader -> buf = realloc(reader -> buf, reader -> size);
+            if (reader -> buf == NULL) {
+                printf("ERR\n");
+                exit(1);
+            }
+        }
+        if (reader -> wake_fd >= 0) { // Waiting for the input and the wake fd together
+            struct pollfd fds[2] = {{reader -> fd, POLLIN, 0}, {reader -> wake_fd, POLLIN, 0}};
+            if (poll(fds, 2, -1) < 0) {
                 continue;
             }
-            if (find_node(arguments, "cd") != NULL) { // Not allowing the use of the 'cd' command
-                printf("cd not supported\n");
-                arguments -> value[0] = '\0';
-                free_list(arguments);
-                arguments = NULL;
-                cmd_token = strtok_r(NULL, ";", &outer_savePtr);
+            if (fds[1].revents & POLLIN) {
+                reader -> on_wake(reader -> ctx);
+            }
+            if (fds[0].revents == 0) {
                 continue;
             }
-            arg_count += counter; // Setting the number of argument
-
-            // Opening the pipes
-            int fd[numOfPipes][2];
-            for (int k = 0; k < numOfPipes; k++) {
-                if (pipe(fd[k]) == -1) {
-                    printf("Error opening the pipe\n");
-                    free_list(env_vars); // Freeing the memory
-                    free_list(arguments);
-                    arguments = NULL;
-                    free(result);
-                    exit(1);
-                }
+        }
+        ssize_t n = read(reader -> fd, reader -> buf + reader -> end, reader -> size - reader -> end - 1); // Room for the terminator
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            reader -> eof = 1;
+        } else {
+            reader -> end += n;
+        }
+    }
+}
+
+// A method to read the bodies of the here-documents of a line from the lines that follow it, each ends with a
+// line that is just its delimiter. With prompt a '> ' asks for every line. Returns -1 if the input ends first,
+// a later call with more input goes on where it stopped.
+int read_heredocs(Arena *arena, CommandLine *cmd_line, LineReader *reader, int prompt){
+    for (HereDoc *doc = cmd_line -> heredocs; doc != NULL; doc = doc -> next) {
+        if (doc -> body != NULL) { // Read by an earlier call
+            continue;
+        }
+        if (doc -> lines.data == NULL) {
+            strbuf_init(&doc -> lines, arena, 256);
+        }
+        while (1) {
+            if (prompt) {
+                printf("> ");
+                fflush(stdout);
+            }
+            char *line = read_line(reader);
+            if (line == NULL) {
+                return -1;
             }
+            if (strcmp(line, doc -> delimiter) == 0) {
+                break;
+            }
+            strbuf_append(&doc -> lines, line, strlen(line));
+            strbuf_append(&doc -> lines, "\n", 1);
+        }
+        doc -> body = doc -> lines.data;
+    }
+    return 0;
+}
 
-            char *args_token, *outer_ptr;
-            while (arguments != NULL) { // Converting the linked list of args into an array
-                int u = 0;
-                args[u] = arguments->name;
-                args_token = strtok_r(arguments->value, " ", &outer_ptr);
-                while (args_token != NULL) {
-                    u++;
-                    if (strcmp(args_token, "") == 0) {
-                        args[u] = NULL;
-                    } else {
-                        args[u] = args_token;
-                    }
-                    args_token = strtok_r(NULL, " ", &outer_ptr);
-                }
-                args[u + 1] = NULL;
-                arguments = arguments->next;
-
-                int redirect = 0;
-                for (int j = 0; j < u; j++) { // Checking to see if we have a redirect command
-                    if (strcmp(args[j], ">") == 0) {
-                        redirect = 1;
-                        output_file = open(args[j + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                        // Removing the redirect arg from the array
-                        args[j] = NULL;
-                        args[j + 1] = NULL;
-                        break;
-                    }
-                }
-                // Executing the commands
-                GLOBAL_PID = fork();
-                command_count++;
-                if (GLOBAL_PID < 0) {
-                    // Fork failed
-                    printf("ERR\n");
-                    free_list(env_vars); // Freeing the memory
-                    free_list(arguments);
-                    arguments = NULL;
-                    free(result);
-                    exit(1);
-                } else if (GLOBAL_PID == 0) {
-                    if (numOfPipes > 0) {
-                        if (pipe_id == 0) {
-                            // First command, redirect STDOUT to the write end of the pipe
-                            dup2(fd[pipe_id][1], STDOUT_FILENO);
-                            close(fd[pipe_id][0]);
-                        } else if (pipe_id == numOfPipes) {
-                            // Last command, redirect STDIN to the read end of the previous pipe
-                            dup2(fd[pipe_id - 1][0], STDIN_FILENO);
-                            close(fd[pipe_id - 1][1]);
-                        } else {
-                            // Middle command, redirect both STDIN and STDOUT to the appropriate pipes
-                            dup2(fd[pipe_id - 1][0], STDIN_FILENO);
-                            close(fd[pipe_id - 1][1]);
-                            dup2(fd[pipe_id][1], STDOUT_FILENO);
-                            close(fd[pipe_id][0]);
-                        }
-                    }
-                    if (redirect == 1){ // Redirect STDOUT to the output file
-                        dup2(output_file, STDOUT_FILENO);
-                    }
-                    if (execvp(args[0], args) < 0) {
-                        printf("ERR\n");
-                        free_list(env_vars); // Freeing the memory
-                        free_list(arguments);
-                        arguments = NULL;
-                        free(result);
-                        exit(1);
-                    }
-                } else { // Parent process
-                    // Saving the pid so what we can wait for them after the piping process is done
-                    pid_array[pipe_id] = GLOBAL_PID;
-                    if (numOfPipes > 0) {
-                        close(fd[pipe_id][1]); // Close the write end of the pipe
-                    }
-                    if (pipe_id > 0) {
-                        close(fd[pipe_id - 1][0]); // Close the read end of the previous pipe
-                    }
-                    if (output_file > 0){ // Closing the output file
-                        close(output_file);
-                    }
-                    if (pipe_id == numOfPipes) {
-                        if (background == 0 && is_pipe == 0) { // Foreground process, wait for child to complete
-                            waitpid(GLOBAL_PID, NULL, WUNTRACED);
-                            GLOBAL_PID = 0;
-                        }
-                        else if (is_pipe == 1){ // Waiting for all the pid of the pipes to end
-                            for (int j = 0; j <= numOfPipes + 1; j++) {
-                                waitpid(pid_array[j], NULL, 0);
-                            }
-                        }
-                        else { // Background process, continue without waiting for child
-                            background_pid = GLOBAL_PID;
-                        }
-                    }
-                    if (is_pipe == 1) { // Increasing the pipe number to get the correct one
-                        pipe_id++;
-                    }
-                }
+// A method to write the prompt into buf
+void prompt_text(char *buf, size_t size, int command_count, int arg_count){
+    char cwd[1024];
+    if(getcwd(cwd, sizeof(cwd)) == NULL){ // Checking to see if the buffer is enough
+        printf("Error with 'getcwd()' function\n");
+        exit(1);
+    }
+    snprintf(buf, size, "#cmd:%d|#args:%d @%s> ", command_count, arg_count, cwd);
+}
+
+// A method to print the prompt to the screen
+void print_prompt(int command_count, int arg_count){
+    char prompt[PROMPT_SIZE];
+    prompt_text(prompt, sizeof(prompt), command_count, arg_count);
+    printf("%s", prompt);
+    fflush(stdout); // The input is read with read(), so stdio will not flush the prompt for us
+}
+
+// A process of a job
+typedef struct job_process{
+    pid_t pid;
+    char state; // 'R' running, 'S' stopped, 'D' done
+    int status; // The exit code, once it is done
+    char name[32]; // The command, cut to fit
+    struct timespec start; // When the shell started to spawn it
+    struct timespec end; // When it was reaped
+    long spawn_ns; // How long the spawn took the shell
+    struct rusage usage; // What it used, filled in by wait4 once it is done
+}JobProcess;
+
+// A pipeline that runs in children, its processes share a process group
+typedef struct job{
+    int id; // The n of %n
+    pid_t pgid; // The process group of the job, 0 when the processes stay in the group of the shell
+    JobProcess *procs;
+    int count;
+    int running; // The number of processes in the 'R' state
+    int stopped; // The number of processes in the 'S' state
+    pid_t last_pid; // The last command of the pipeline, -1 when it did not run in a child
+    int status; // The exit code of the last command
+    int notified; // Set once a stop was reported
+    char *text; // The command line of the job, for 'jobs'
+    int timed; // Set when the job started with 'time'
+    struct timespec start; // When the pipeline started
+    long parse_ns; // How long parsing the line of the job took
+    int status_fd; // A memfd with the PARALLEL_STATUS of a 'parallel' that runs in a copy of the shell, -1 for none
+    struct memo_run *memo; // The entry of 'memo' the output of the job goes into, NULL for none
+}Job;
+
+#define HISTORY_NONE UINT32_MAX // No line
+
+// A line of the history, the lines of the file point into its mapping and are not null terminated
+typedef struct history_line{
+    const char *text;
+    uint32_t length;
+    uint32_t previous; // The newest older line with the same text, HISTORY_NONE for none
+}HistoryLine;
+
+// A node of the radix tree of the history, its label is a piece of one of the lines
+typedef struct history_node{
+    uint32_t line; // The line the label is taken from
+    uint32_t start; // Where the label starts in the line, which is also the depth of the parent
+    uint32_t length; // The length of the label
+    uint32_t latest; // The newest line under the node
+    uint32_t ends; // The newest line that ends at the node, the older ones follow its previous links
+    uint32_t child; // The first child, 0 for none
+    uint32_t next; // The next child of the parent, 0 for none
+}HistoryNode;
+
+// The history: an append only file and a radix tree of its lines. The file is mapped and the tree is built on
+// the first lookup, so the startup does not get slower as the file grows.
+typedef struct history{
+    int fd; // The file, -1 when the shell keeps no history
+    off_t start_size; // The size of the file at startup, the lines after it are ours or of other shells
+    const char *map; // The mapping of the lines the file had at startup, NULL until it is indexed
+    size_t map_size;
+    HistoryLine *lines; // The lines of the file, then the new ones. Only the new ones until the file is indexed
+    size_t count;
+    size_t capacity;
+    size_t file_count; // The number of lines of the file, once it is indexed
+    int indexed; // Set once the lines of the file are in lines and every line is in the tree
+    HistoryNode *nodes; // Node 0 is the root
+    size_t node_count;
+    size_t node_capacity;
+    char *pending; // The new lines that are not written yet, they are written and synced in batches
+    size_t pending_length;
+    size_t pending_capacity;
+    int pending_lines;
+}History;
+
+// The cache of 'memo', a directory with one file per entry named by the hash of its key. A file holds the output
+// of the pipeline followed by the key and a MemoTrailer, and its mtime is when it was last used.
+typedef struct memo_cache{
+    char *dir; // NULL until the first 'memo'
+    long long size; // The bytes of all the entries, counted when the directory is opened and then kept up to date
+    long hits;
+    long misses;
+    long stores;
+    long evictions;
+    long bypassed; // The pipelines that could not be cached and ran as they are
+    long long replayed; // The bytes of output that came from the cache
+}MemoCache;
+
+// The end of an entry of the cache of 'memo'
+typedef struct memo_trailer{
+    uint64_t key_length; // The key is right before the trailer
+    int32_t status; // The exit code of the pipeline
+    uint32_t unused;
+    uint64_t magic; // MEMO_MAGIC
+}MemoTrailer;
+
+// A miss of 'memo' whose pipeline is still running, its job holds it so a stop with ctrl z does not lose the
+// output that comes after 'fg'
+typedef struct memo_run{
+    int out; // The new entry the stdout of the pipeline goes into
+    int stdout_fd; // The stdout of the shell when the pipeline started, the output is replayed there
+    char *temp; // The name of the new entry
+    char *path; // The name it gets once it is complete
+    char *key;
+    size_t key_length;
+}MemoRun;
+
+// The state of the shell
+typedef struct shell{
+    VarTable vars; // The environment variables
+    Arena arena; // The memory of the current line
+    int command_count; // The number of executed commands
+    int arg_count; // The number of arguments of the executed commands
+    int last_status; // The exit status of the last foreground pipeline
+    SpawnStrategy spawn; // How the children are started
+    VarTable *path_cache; // The resolved path of every command we ran, by command name, shared by the sessions of a server
+    VarTable own_path_cache; // The cache of this shell, a session switches to it once it sets a PATH of its own
+    Job **jobs; // The job table, job n is at n - 1 and a removed job leaves NULL
+    int job_capacity;
+    int job_count; // The highest job number in use
+    int current_job; // The job '%%' refers to, 0 if there is none
+    int signal_fd; // A signalfd for SIGCHLD, reading it tells us to reap
+    int interactive; // Set when the shell reads a terminal and does job control
+    pid_t pgid; // The process group of the shell
+    pid_t pid; // The pid of the shell, for '$$'
+    char number[24]; // Where '$?' and '$$' are written when they are expanded
+    int stats; // Set by 'stats on', every pipeline prints its timing like with 'time'
+    int stats_fd; // The JSON lines log of 'stats log', -1 when there is none
+    long parse_ns; // How long parsing the current line took
+    int async; // Set for a session of a server, a foreground job is waited for by the server and not by the shell
+    Job *waiting; // The foreground job an async shell waits for before the rest of its line runs
+    int wait_again; // Set when 'wait' parked the line on a job, it runs again once the job is done
+    void (*on_other_child)(void *ctx, pid_t pid, int status, const struct rusage *usage); // A child of no job of ours
+    void *ctx;
+    History history; // The lines read from the terminal
+    struct glob_dir *glob_dirs; // The directories the globs of the current pipeline read, they live in the arena
+    int *sched_cpus; // The order 'sched -c auto' gives out the CPUs in, found on its first use
+    int sched_cpu_count;
+    int sched_next; // The next CPU of the order
+    MemoCache memo; // The cache of 'memo' and how well it did
+    MemoRun *memo_run; // The miss of 'memo' that is starting, the job of its pipeline takes it
+}Shell;
+
+// A method to write a whole buffer to an fd, returns -1 if the fd is closed or broken
+int write_all(int fd, const char *data, size_t length){
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            cmd_token = strtok_r(NULL, ";", &outer_savePtr); // Getting the next command
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// A method to write the output of a builtin to its fd with one write
+int strbuf_write(StrBuf *buf, int fd){
+    return write_all(fd, buf -> data, buf -> length);
+}
+
+// A method to get the nanoseconds from one time to another
+long elapsed_ns(const struct timespec *from, const struct timespec *to){
+    return (to -> tv_sec - from -> tv_sec) * 1000000000L + (to -> tv_nsec - from -> tv_nsec);
+}
+
+// A method to get the microseconds of a time of rusage
+long timeval_us(const struct timeval *time){
+    return time -> tv_sec * 1000000L + time -> tv_usec;
+}
+
+// A method to append a string as a quoted JSON string
+void strbuf_json(StrBuf *buf, const char *str){
+    strbuf_append(buf, "\"", 1);
+    const char *run = str; // The chars since the last escape are appended at once
+    for (const char *p = str; *p != '\0'; p++) {
+        if (*p != '"' && *p != '\\' && (unsigned char)*p >= 0x20) {
+            continue;
+        }
+        strbuf_append(buf, run, p - run);
+        if (*p == '"' || *p == '\\') {
+            strbuf_printf(buf, "\\%c", *p);
+        } else {
+            strbuf_printf(buf, "\\u%04x", (unsigned char)*p);
+        }
+        run = p + 1;
+    }
+    strbuf_append(buf, run, strlen(run));
+    strbuf_append(buf, "\"", 1);
+}
+
+// A method to open the history file, its lines are only mapped and read once they are looked up
+void history_open(History *history, const char *path){
+    memset(history, 0, sizeof(*history));
+    history -> fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    struct stat st;
+    if (history -> fd >= 0 && fstat(history -> fd, &st) == 0) {
+        history -> start_size = st.st_size;
+    }
+}
+
+// A method to map the lines the file had at startup. Another shell may have truncated the file since, and
+// touching a mapped page past its end raises SIGBUS, so the mapping never goes past the size the file has now.
+void history_map(History *history){
+    struct stat st;
+    if (fstat(history -> fd, &st) < 0) {
+        return;
+    }
+    size_t size = st.st_size < history -> start_size ? st.st_size : history -> start_size;
+    if (size == 0) {
+        return;
+    }
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, history -> fd, 0);
+    if (map != MAP_FAILED) {
+        history -> map = map;
+        history -> map_size = size;
+    }
+}
+
+// A method to make room for n more lines
+void history_reserve(History *history, size_t n){
+    if (history -> count + n <= history -> capacity) {
+        return;
+    }
+    history -> capacity = history -> capacity == 0 ? 64 : history -> capacity * 2;
+    if (history -> capacity < history -> count + n) {
+        history -> capacity = history -> count + n;
+    }
+    history -> lines = realloc(history -> lines, history -> capacity * sizeof(HistoryLine));
+    if (history -> lines == NULL) {
+        printf("ERR\n");
+        exit(1);
+    }
+}
+
+// A method to get the first char of the label of a node
+char history_label(History *history, uint32_t node){
+    HistoryNode *n = &history -> nodes[node];
+    return history -> lines[n -> line].text[n -> start];
+}
+
+// A method to add a node to the tree, the caller made room for it
+uint32_t history_node(History *history, uint32_t line, uint32_t start, uint32_t length){
+    HistoryNode *node = &history -> nodes[history -> node_count];
+    node -> line = node -> latest = line;
+    node -> start = start;
+    node -> length = length;
+    node -> ends = HISTORY_NONE;
+    node -> child = node -> next = 0;
+    return history -> node_count++;
+}
+
+// A method to add a line to the tree, every node on its path gets it as its newest line and the node it ends at
+// links it to the line that ended there before
+void history_insert(History *history, uint32_t id){
+    if (history -> node_count + 2 > history -> node_capacity) { // A line adds a leaf and splits at most one node
+        history -> node_capacity = history -> node_capacity == 0 ? 256 : history -> node_capacity * 2;
+        history -> nodes = realloc(history -> nodes, history -> node_capacity * sizeof(HistoryNode));
+        if (history -> nodes == NULL) {
+            printf("ERR\n");
+            exit(1);
+        }
+    }
+    if (history -> node_count == 0) {
+        history_node(history, id, 0, 0);
+    }
+    const char *text = history -> lines[id].text;
+    size_t length = history -> lines[id].length, depth = 0;
+    uint32_t node = 0;
+    history -> nodes[0].latest = id;
+    while (depth < length) {
+        uint32_t *link = &history -> nodes[node].child; // The link to the child, a split puts a node in between
+        while (*link != 0 && history_label(history, *link) != text[depth]) {
+            link = &history -> nodes[*link].next;
+        }
+        if (*link == 0) { // The rest of the line is a new leaf
+            node = *link = history_node(history, id, depth, length - depth);
+            break;
+        }
+        HistoryNode *child = &history -> nodes[*link];
+        const char *label = history -> lines[child -> line].text + child -> start;
+        size_t common = 1, most = child -> length < length - depth ? child -> length : length - depth;
+        while (common < most && label[common] == text[depth + common]) {
+            common++;
         }
+        if (common < child -> length) { // The line leaves the label in the middle, splitting the node there
+            uint32_t split = history_node(history, child -> line, child -> start, common);
+            history -> nodes[split].child = *link;
+            history -> nodes[split].next = child -> next;
+            child -> next = 0;
+            child -> start += common;
+            child -> length -= common;
+            *link = split;
+        }
+        node = *link;
+        history -> nodes[node].latest = id;
+        depth += common;
+    }
+    history -> lines[id].previous = history -> nodes[node].ends;
+    history -> nodes[node].ends = id;
+}
+
+// A method to read the lines of the file and build the tree, once. The lines added before go after the file.
+void history_index(History *history){
+    if (history -> indexed || history -> fd < 0) {
+        return;
     }
-}
\ No newline at end of file
+    history -> indexed = 1;
+    history_map(history);
+    size_t file_count = 0;
+    const char *p = history -> map, *end = history -> map + history -> map_size;
+    while (p < end) { // Counting first, so the lines are moved only once
+        const char *newline = memchr(p, '\n', end - p);
+        file_count++;
+        p = newline != NULL ? newline + 1 : end;
+    }
+    size_t added = history -> count;
+    history_reserve(history, file_count);
+    memmove(history -> lines + file_count, history -> lines, added * sizeof(HistoryLine));
+    history -> count = 0;
+    for (p = history -> map; p < end; history -> count++) {
+        const char *newline = memchr(p, '\n', end - p);
+        size_t length = (newline != NULL ? newline : end) - p;
+        history -> lines[history -> count] = (HistoryLine){p, length, HISTORY_NONE};
+        p += length + 1;
+    }
+    history -> file_count = file_count;
+    history -> count += added;
+    for (size_t i = 0; i < history -> count; i++) {
+        history_insert(history, i);
+    }
+}
+
+// A method to write the new lines to the file and sync it
+void history_flush(History *history){
+    if (history -> pending_length == 0) {
+        return;
+    }
+    write_all(history -> fd, history -> pending, history -> pending_length);
+    fdatasync(history -> fd);
+    history -> pending_length = 0;
+    history -> pending_lines = 0;
+}
+
+// A method to add a line to the history, the file gets it with the next batch
+void history_add(History *history, const char *line){
+    if (history -> fd < 0) {
+        return;
+    }
+    size_t length = strlen(line);
+    history_reserve(history, 1);
+    char *copy = malloc(length + 1);
+    if (history -> pending_length + length + 1 > history -> pending_capacity) {
+        history -> pending_capacity = (history -> pending_length + length + 1) * 2;
+        history -> pending = realloc(history -> pending, history -> pending_capacity);
+    }
+    if (copy == NULL || history -> pending == NULL) {
+        printf("ERR\n");
+        exit(1);
+    }
+    memcpy(copy, line, length + 1);
+    history -> lines[history -> count] = (HistoryLine){copy, length, HISTORY_NONE};
+    if (history -> indexed) {
+        history_insert(history, history -> count);
+    }
+    history -> count++;
+    memcpy(history -> pending + history -> pending_length, line, length);
+    history -> pending_length += length;
+    history -> pending[history -> pending_length++] = '\n';
+    if (++history -> pending_lines >= HISTORY_BATCH) {
+        history_flush(history);
+    }
+}
+
+// A method to find the node of the tree whose lines are the ones that start with a prefix, it takes
+// O(length of the prefix). Returns -1 if no line starts with it.
+long history_prefix_node(History *history, const char *prefix, size_t length){
+    history_index(history);
+    if (history -> count == 0) {
+        return -1;
+    }
+    uint32_t node = 0;
+    size_t depth = 0;
+    while (depth < length) {
+        uint32_t child = history -> nodes[node].child;
+        while (child != 0 && history_label(history, child) != prefix[depth]) {
+            child = history -> nodes[child].next;
+        }
+        if (child == 0) {
+            return -1;
+        }
+        HistoryNode *n = &history -> nodes[child];
+        size_t most = n -> length < length - depth ? n -> length : length - depth;
+        if (memcmp(history -> lines[n -> line].text + n -> start, prefix + depth, most) != 0) {
+            return -1;
+        }
+        depth += most;
+        node = child;
+    }
+    return node;
+}
+
+// A method to find the newest line that starts with a prefix, returns -1 if there is none
+long history_latest(History *history, const char *prefix, size_t length){
+    long node = history_prefix_node(history, prefix, length);
+    if (node < 0) {
+        return -1;
+    }
+    return history -> nodes[node].latest;
+}
+
+// A method to find the newest line under a node that is older than line 'before', or 'best' if none is newer
+// than it. A subtree whose newest line is older than 'before' is done in one step, so only the nodes of the
+// lines that are newer than 'before' are walked.
+long history_before(History *history, uint32_t node, long before, long best){
+    HistoryNode *n = &history -> nodes[node];
+    if ((long)n -> latest <= best) {
+        return best;
+    }
+    if ((long)n -> latest < before) {
+        return n -> latest;
+    }
+    for (uint32_t id = n -> ends; id != HISTORY_NONE && (long)id > best; id = history -> lines[id].previous) {
+        if ((long)id < before) {
+            best = id;
+            break;
+        }
+    }
+    for (uint32_t child = n -> child; child != 0; child = history -> nodes[child].next) {
+        best = history_before(history, child, before, best);
+    }
+    return best;
+}
+
+// A method to put every line under a node into ids, in no order, and return how many there are. With ids NULL it
+// only counts them.
+size_t history_collect(History *history, uint32_t node, uint32_t *ids){
+    size_t count = 0;
+    for (uint32_t id = history -> nodes[node].ends; id != HISTORY_NONE; id = history -> lines[id].previous) {
+        if (ids != NULL) {
+            ids[count] = id;
+        }
+        count++;
+    }
+    for (uint32_t child = history -> nodes[node].child; child != 0; child = history -> nodes[child].next) {
+        count += history_collect(history, child, ids != NULL ? ids + count : NULL);
+    }
+    return count;
+}
+
+// A method to compare two lines of the history for qsort, the newest first
+int history_newest_first(const void *a, const void *b){
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// A method to find the newest line before line 'before' that starts with a prefix, so a search can go back one
+// match at a time. Returns -1 if there is none.
+long history_find(History *history, const char *prefix, size_t length, long before){
+    long node = history_prefix_node(history, prefix, length);
+    return node < 0 ? -1 : history_before(history, node, before, -1);
+}
+
+// A method to write the last batch and release the history
+void history_close(History *history){
+    if (history -> fd < 0) {
+        return;
+    }
+    history_flush(history);
+    for (size_t i = history -> file_count; i < history -> count; i++) {
+        free((char *)history -> lines[i].text);
+    }
+    if (history -> map != NULL) {
+        munmap((void *)history -> map, history -> map_size);
+    }
+    close(history -> fd);
+    free(history -> lines);
+    free(history -> nodes);
+    free(history -> pending);
+    memset(history, 0, sizeof(*history));
+    history -> fd = -1;
+}
+
+// A method to get the PATH the commands are searched in, a shell variable hides the environment
+const char *search_path(Shell *shell){
+    const char *path = var_get(&shell -> vars, "PATH");
+    if (path == NULL) {
+        path = getenv("PATH");
+    }
+    return path != NULL ? path : "/usr/local/bin:/usr/bin:/bin";
+}
+
+// A method to search PATH for a command, the result lives in the arena and is NULL if there is no such command
+char *find_in_path(Shell *shell, const char *name){
+    const char *dir = search_path(shell);
+    size_t name_len = strlen(name);
+    while (1) {
+        const char *end = strchrnul(dir, ':');
+        size_t dir_len = end - dir;
+        char *candidate = arena_alloc(&shell -> arena, dir_len + name_len + 3);
+        if (dir_len == 0) { // An empty entry is the current directory
+            candidate[0] = '.';
+            dir_len = 1;
+        } else {
+            memcpy(candidate, dir, dir_len);
+        }
+        candidate[dir_len] = '/';
+        memcpy(candidate + dir_len + 1, name, name_len + 1);
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            return candidate;
+        }
+        if (*end == '\0') {
+            return NULL;
+        }
+        dir = end + 1;
+    }
+}
+
+// A method to get the path of a command from the cache, searching PATH only on a miss
+const char *resolve_command(Shell *shell, const char *name, int *cached){
+    *cached = 0;
+    if (strchr(name, '/') != NULL) { // A path is executed as it is
+        return name;
+    }
+    const char *path = var_get(shell -> path_cache, name);
+    if (path != NULL) {
+        *cached = 1;
+        return path;
+    }
+    path = find_in_path(shell, name);
+    if (path != NULL) {
+        var_set(shell -> path_cache, name, path);
+    }
+    return path;
+}
+
+// A method to drop the cached paths when a variable that decides them changes
+void variable_changed(Shell *shell, const char *name){
+    if (strcmp(name, "PATH") == 0) { // A session of a server stops sharing the cache of the server
+        shell -> path_cache = &shell -> own_path_cache;
+        var_free(shell -> path_cache);
+    }
+}
+
+// A method to turn a wait status into an exit code
+int exit_code(int status){
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return 128 + WSTOPSIG(status);
+}
+
+// A method to write the raw words of a pipeline back as a command line, for 'jobs'
+char *pipeline_text(Pipeline *pipeline){
+    size_t length = 1;
+    for (int i = 0; i < pipeline -> count; i++) {
+        Command *command = &pipeline -> commands[i];
+        for (int j = 0; j < command -> argc; j++) {
+            length += strlen(command -> argv[j]) + 1;
+        }
+        for (int j = 0; j < command -> redirect_count; j++) {
+            length += strlen(command -> redirects[j].target) + 6; // An fd, the longest operator '<<<' and two spaces
+        }
+        for (int j = 0; j < command -> fanout_count; j++) {
+            length += strlen(command -> fanout[j]) + 4;
+        }
+        length += 2;
+    }
+    char *text = malloc(length), *p = text;
+    if (text == NULL) {
+        printf("ERR\n");
+        exit(1);
+    }
+    for (int i = 0; i < pipeline -> count; i++) {
+        Command *command = &pipeline -> commands[i];
+        if (i > 0) {
+            p = stpcpy(p, "| ");
+        }
+        for (int j = 0; j < command -> argc; j++) {
+            p = stpcpy(stpcpy(p, command -> argv[j]), " ");
+        }
+        for (int j = 0; j < command -> redirect_count; j++) {
+            Redirect *redirect = &command -> redirects[j];
+            int default_fd = redirect -> flags == O_RDONLY ? STDIN_FILENO : STDOUT_FILENO;
+            if (redirect -> fd != default_fd) {
+                *p++ = '0' + redirect -> fd;
+            }
+            if (redirect -> kind == REDIRECT_HERE_DOC) {
+                p = stpcpy(p, "<< ");
+            } else if (redirect -> kind == REDIRECT_HERE_STRING) {
+                p = stpcpy(p, "<<< ");
+            } else {
+                p = stpcpy(p, redirect -> flags == O_RDONLY ? "< " : (redirect -> flags & O_APPEND ? ">> " : "> "));
+            }
+            p = stpcpy(stpcpy(p, redirect -> target), " ");
+        }
+        for (int j = 0; j < command -> fanout_count; j++) {
+            p = stpcpy(stpcpy(stpcpy(p, j == 0 ? "|> " : ""), command -> fanout[j]), " ");
+        }
+    }
+    p[-1] = '\0'; // Dropping the last space
+    return text;
+}
+
+// A method to add a job to the table, it gets the lowest free number
+Job *job_add(Shell *shell, Pipeline *pipeline, pid_t pgid){
+    int id = 1;
+    while (id <= shell -> job_capacity && shell -> jobs[id - 1] != NULL) {
+        id++;
+    }
+    if (id > shell -> job_capacity) {
+        int capacity = shell -> job_capacity == 0 ? 16 : shell -> job_capacity * 2;
+        shell -> jobs = realloc(shell -> jobs, capacity * sizeof(Job *));
+        if (shell -> jobs == NULL) {
+            printf("ERR\n");
+            exit(1);
+        }
+        memset(shell -> jobs + shell -> job_capacity, 0, (capacity - shell -> job_capacity) * sizeof(Job *));
+        shell -> job_capacity = capacity;
+    }
+    int slots = pipeline -> count; // Every command, and the child of each '|>'
+    for (int i = 0; i < pipeline -> count; i++) {
+        slots += pipeline -> commands[i].fanout_count > 0;
+    }
+    Job *job = calloc(1, sizeof(Job));
+    if (job == NULL || (job -> procs = malloc(slots * sizeof(JobProcess))) == NULL) {
+        printf("ERR\n");
+        exit(1);
+    }
+    job -> id = id;
+    job -> pgid = pgid;
+    job -> last_pid = -1;
+    job -> status_fd = -1;
+    job -> memo = shell -> memo_run;
+    shell -> memo_run = NULL;
+    job -> text = pipeline_text(pipeline);
+    shell -> jobs[id - 1] = job;
+    if (id > shell -> job_count) {
+        shell -> job_count = id;
+    }
+    return job;
+}
+
+// A method to add a running process to a job, the spawn started at 'start'
+void job_add_process(Job *job, pid_t pid, const char *name, const struct timespec *start){
+    JobProcess *proc = &job -> procs[job -> count];
+    memset(proc, 0, sizeof(JobProcess));
+    proc -> pid = pid;
+    proc -> state = 'R';
+    snprintf(proc -> name, sizeof(proc -> name), "%s", name);
+    proc -> start = *start;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    proc -> spawn_ns = elapsed_ns(start, &now);
+    job -> count++;
+    job -> running++;
+}
+
+// A method to report where the time of a finished job went, on stderr for 'time' and 'stats on' and as one
+// JSON line for 'stats log'. Every stage gets what wait4 told about it, the shell's own part is the parse
+// of the line and the spawns.
+void job_report(Shell *shell, Job *job){
+    int print = job -> timed || shell -> stats;
+    if (!print && shell -> stats_fd < 0) {
+        return;
+    }
+    struct timespec end, now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    end = job -> count > 0 ? job -> start : now; // A job is over when its last process was reaped
+    long user_us = 0, sys_us = 0, spawn_ns = 0;
+    for (int i = 0; i < job -> count; i++) {
+        JobProcess *proc = &job -> procs[i];
+        user_us += timeval_us(&proc -> usage.ru_utime);
+        sys_us += timeval_us(&proc -> usage.ru_stime);
+        spawn_ns += proc -> spawn_ns;
+        if (proc -> state == 'D' && elapsed_ns(&end, &proc -> end) > 0) {
+            end = proc -> end;
+        }
+    }
+    long real_ns = elapsed_ns(&job -> start, &end);
+    StrBuf out;
+    strbuf_init(&out, &shell -> arena, 256);
+    if (print) {
+        strbuf_printf(&out, "real %.3fs  user %.3fs  sys %.3fs  shell: parse %ldus spawn %ldus\n", real_ns / 1e9,
+                      user_us / 1e6, sys_us / 1e6, job -> parse_ns / 1000, spawn_ns / 1000);
+        for (int i = 0; i < job -> count; i++) {
+            JobProcess *proc = &job -> procs[i];
+            long stage_ns = proc -> state == 'D' ? elapsed_ns(&proc -> start, &proc -> end) : 0;
+            strbuf_printf(&out, "  %-12s pid %-7d real %.3fs  user %.3fs  sys %.3fs  rss %ldKB  csw %ld/%ld  spawn %ldus  exit %d\n",
+                          proc -> name, proc -> pid, stage_ns / 1e9, timeval_us(&proc -> usage.ru_utime) / 1e6,
+                          timeval_us(&proc -> usage.ru_stime) / 1e6, proc -> usage.ru_maxrss, proc -> usage.ru_nvcsw,
+                          proc -> usage.ru_nivcsw, proc -> spawn_ns / 1000, proc -> status);
+        }
+        fflush(stdout);
+        strbuf_write(&out, STDERR_FILENO);
+    }
+    if (shell -> stats_fd >= 0) {
+        struct timespec wall;
+        clock_gettime(CLOCK_REALTIME, &wall);
+        out.length = 0;
+        strbuf_printf(&out, "{\"time\":%ld.%03ld,\"command\":", (long)wall.tv_sec, wall.tv_nsec / 1000000);
+        strbuf_json(&out, job -> text);
+        strbuf_printf(&out, ",\"status\":%d,\"real_us\":%ld,\"user_us\":%ld,\"sys_us\":%ld,\"parse_us\":%ld,\"spawn_us\":%ld,\"stages\":[",
+                      job -> status, real_ns / 1000, user_us, sys_us, job -> parse_ns / 1000, spawn_ns / 1000);
+        for (int i = 0; i < job -> count; i++) {
+            JobProcess *proc = &job -> procs[i];
+            long stage_ns = proc -> state == 'D' ? elapsed_ns(&proc -> start, &proc -> end) : 0;
+            strbuf_printf(&out, "%s{\"command\":", i > 0 ? "," : "");
+            strbuf_json(&out, proc -> name);
+            strbuf_printf(&out, ",\"pid\":%d,\"status\":%d,\"real_us\":%ld,\"user_us\":%ld,\"sys_us\":%ld,\"maxrss_kb\":%ld,"
+                          "\"voluntary_csw\":%ld,\"involuntary_csw\":%ld,\"spawn_us\":%ld}",
+                          proc -> pid, proc -> status, stage_ns / 1000, timeval_us(&proc -> usage.ru_utime),
+                          timeval_us(&proc -> usage.ru_stime), proc -> usage.ru_maxrss, proc -> usage.ru_nvcsw,
+                          proc -> usage.ru_nivcsw, proc -> spawn_ns / 1000);
+        }
+        strbuf_printf(&out, "]}\n");
+        strbuf_write(&out, shell -> stats_fd);
+    }
+}
+
+void memo_finish(Shell *shell, MemoRun *run, int status, int complete);
+
+// A method to remove a job from the table and release it, a finished job reports its timing on the way out
+// and finishes its entry of 'memo'
+void job_remove(Shell *shell, Job *job){
+    int complete = job -> running == 0 && job -> stopped == 0;
+    if (complete) {
+        job_report(shell, job);
+    }
+    if (job -> memo != NULL) {
+        memo_finish(shell, job -> memo, job -> last_pid > 0 ? job -> status : shell -> last_status, complete);
+    }
+    shell -> jobs[job -> id - 1] = NULL;
+    while (shell -> job_count > 0 && shell -> jobs[shell -> job_count - 1] == NULL) {
+        shell -> job_count--;
+    }
+    if (shell -> current_job == job -> id) { // The newest job that is left becomes the current one
+        shell -> current_job = shell -> job_count;
+    }
+    if (job -> status_fd >= 0) {
+        close(job -> status_fd);
+    }
+    free(job -> procs);
+    free(job -> text);
+    free(job);
+}
+
+// A method to update the process of a job after wait4 reported a change, returns 0 if no job has the pid
+int job_update(Shell *shell, pid_t pid, int status, const struct rusage *usage){
+    for (int i = 0; i < shell -> job_count; i++) {
+        Job *job = shell -> jobs[i];
+        for (int j = 0; job != NULL && j < job -> count; j++) {
+            JobProcess *proc = &job -> procs[j];
+            if (proc -> pid != pid) {
+                continue;
+            }
+            if (proc -> state == 'R') {
+                job -> running--;
+            } else if (proc -> state == 'S') {
+                job -> stopped--;
+            }
+            if (WIFSTOPPED(status)) {
+                proc -> state = 'S';
+                job -> stopped++;
+                job -> notified = 0;
+                shell -> current_job = job -> id;
+            } else if (WIFCONTINUED(status)) {
+                proc -> state = 'R';
+                job -> running++;
+            } else {
+                proc -> state = 'D';
+                proc -> status = exit_code(status);
+                proc -> usage = *usage;
+                clock_gettime(CLOCK_MONOTONIC, &proc -> end);
+                if (pid == job -> last_pid) {
+                    job -> status = exit_code(status);
+                }
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// A method to wait for every child that changed its state, without blocking
+void collect_children(Shell *shell){
+    int status;
+    pid_t pid;
+    struct rusage usage;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        if (!job_update(shell, pid, status, &usage) && shell -> on_other_child != NULL) {
+            shell -> on_other_child(shell -> ctx, pid, status, &usage);
+        }
+    }
+}
+
+// A method to reap every child that changed its state, called when the signalfd has a SIGCHLD for us
+void reap_children(Shell *shell){
+    struct signalfd_siginfo info;
+    while (read(shell -> signal_fd, &info, sizeof(info)) == sizeof(info)); // Several SIGCHLDs can be merged into one
+    collect_children(shell);
+}
+
+// A method to wait until a job is done or stopped, the other children that change on the way are updated too
+void job_wait(Shell *shell, Job *job){
+    while (job -> running > 0) {
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, WUNTRACED, &usage);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            for (int i = 0; i < job -> count; i++) { // No children are left, so nothing of the job is running
+                if (job -> procs[i].state == 'R') {
+                    job -> procs[i].state = 'D';
+                }
+            }
+            job -> running = 0;
+            break;
+        }
+        if (!job_update(shell, pid, status, &usage) && shell -> on_other_child != NULL) {
+            shell -> on_other_child(shell -> ctx, pid, status, &usage);
+        }
+    }
+}
+
+// A method to send a signal to every process of a job
+void job_signal(Job *job, int sig){
+    if (job -> pgid > 0) {
+        kill(-job -> pgid, sig);
+        return;
+    }
+    for (int i = 0; i < job -> count; i++) {
+        if (job -> procs[i].state != 'D') {
+            kill(job -> procs[i].pid, sig);
+        }
+    }
+}
+
+// A method to resume the stopped processes of a job
+void job_continue(Shell *shell, Job *job){
+    job_signal(job, SIGCONT);
+    for (int i = 0; i < job -> count; i++) {
+        if (job -> procs[i].state == 'S') {
+            job -> procs[i].state = 'R';
+            job -> stopped--;
+            job -> running++;
+        }
+    }
+    shell -> current_job = job -> id;
+}
+
+// A method to finish a foreground job once it is done or stopped
+void job_settle(Shell *shell, Job *job){
+    if (job -> stopped > 0) { // Stopped with ctrl z, 'fg' and 'bg' can resume it
+        printf("\n[%d]+  Stopped                 %s\n", job -> id, job -> text);
+        job -> notified = 1;
+        shell -> current_job = job -> id;
+        shell -> last_status = 128 + SIGTSTP;
+        return;
+    }
+    if (job -> last_pid > 0) {
+        shell -> last_status = job -> status;
+    }
+    struct stat st;
+    if (job -> status_fd >= 0 && fstat(job -> status_fd, &st) == 0) { // The copy of the shell that ran 'parallel'
+        char *statuses = arena_alloc(&shell -> arena, st.st_size + 1);
+        ssize_t n = pread(job -> status_fd, statuses, st.st_size, 0);
+        statuses[n > 0 ? n : 0] = '\0';
+        var_set(&shell -> vars, "PARALLEL_STATUS", statuses);
+    }
+    if (shell -> interactive && job -> status == 128 + SIGINT) { // Moving the prompt past the ^C
+        printf("\n");
+    }
+    job_remove(shell, job);
+}
+
+// A method to run a job in the foreground until it is done or stopped
+void job_foreground(Shell *shell, Job *job){
+    if (shell -> interactive && job -> pgid > 0) { // The job gets the terminal while it runs
+        tcsetpgrp(STDIN_FILENO, job -> pgid);
+    }
+    job_wait(shell, job);
+    if (shell -> interactive) {
+        tcsetpgrp(STDIN_FILENO, shell -> pgid);
+    }
+    job_settle(shell, job);
+}
+
+// A method to describe the state of a job for 'jobs'
+void job_state(Job *job, char *buf, size_t size){
+    if (job -> running > 0) {
+        snprintf(buf, size, "Running");
+    } else if (job -> stopped > 0) {
+        snprintf(buf, size, "Stopped");
+    } else if (job -> status == 0) {
+        snprintf(buf, size, "Done");
+    } else {
+        snprintf(buf, size, "Exit %d", job -> status);
+    }
+}
+
+// A method to check if a job finished or stopped since it was last reported
+int job_reportable(Job *job){
+    return job != NULL && job -> running == 0 && !(job -> stopped > 0 && job -> notified);
+}
+
+// A method to report the jobs that finished or stopped since the last prompt, the finished ones leave the table
+void report_jobs(Shell *shell, int print){
+    for (int i = 0; i < shell -> job_count; i++) {
+        Job *job = shell -> jobs[i];
+        if (!job_reportable(job)) {
+            continue;
+        }
+        if (print) {
+            char state[32];
+            job_state(job, state, sizeof(state));
+            printf("[%d]%c  %-22s  %s\n", job -> id, job -> id == shell -> current_job ? '+' : ' ', state, job -> text);
+        }
+        if (job -> stopped > 0) {
+            job -> notified = 1;
+        } else {
+            job_remove(shell, job);
+        }
+    }
+    fflush(stdout);
+}
+
+// A method to find the job of a '%n', '%%', '%+' or '%' argument, or the job of a pid
+Job *job_parse(Shell *shell, const char *arg){
+    if (arg == NULL || strcmp(arg, "%") == 0 || strcmp(arg, "%%") == 0 || strcmp(arg, "%+") == 0) {
+        return shell -> current_job > 0 ? shell -> jobs[shell -> current_job - 1] : NULL;
+    }
+    if (arg[0] == '%') {
+        int id = atoi(arg + 1);
+        return id > 0 && id <= shell -> job_count ? shell -> jobs[id - 1] : NULL;
+    }
+    pid_t pid = atoi(arg);
+    for (int i = 0; i < shell -> job_count; i++) {
+        Job *job = shell -> jobs[i];
+        for (int j = 0; job != NULL && j < job -> count; j++) {
+            if (job -> procs[j].pid == pid) {
+                return job;
+            }
+        }
+    }
+    return NULL;
+}
+
+// A method to release the job table, the jobs that still run are left alone
+void free_jobs(Shell *shell){
+    for (int i = 0; i < shell -> job_count; i++) {
+        if (shell -> jobs[i] != NULL) {
+            job_remove(shell, shell -> jobs[i]);
+        }
+    }
+    free(shell -> jobs);
+    shell -> jobs = NULL;
+    shell -> job_capacity = shell -> job_count = 0;
+}
+
+// A builtin gets the fd its output goes to, and returns its exit status
+typedef int (*BuiltinFunc)(Shell *shell, int argc, char **argv, int out_fd);
+
+#define BUILTIN_PIPEABLE 1 // Can be a stage of a pipeline, it stands in for a program so it is counted like one
+
+// An entry of the builtin dispatch table
+typedef struct builtin{
+    const char *name;
+    BuiltinFunc run;
+    int flags;
+}Builtin;
+
+// Listing the jobs, the finished ones are reported once and leave the table
+int builtin_jobs(Shell *shell, int argc, char **argv, int out_fd){
+    (void)argc, (void)argv;
+    reap_children(shell);
+    StrBuf out;
+    strbuf_init(&out, &shell -> arena, 256);
+    for (int i = 0; i < shell -> job_count; i++) {
+        Job *job = shell -> jobs[i];
+        if (job == NULL) {
+            continue;
+        }
+        char state[32];
+        job_state(job, state, sizeof(state));
+        strbuf_printf(&out, "[%d]%c  %-22s  %s%s\n", job -> id, job -> id == shell -> current_job ? '+' : ' ', state,
+                      job -> text, job -> running > 0 ? " &" : "");
+        if (job -> stopped > 0) {
+            job -> notified = 1;
+        } else if (job -> running == 0) {
+            job_remove(shell, job);
+        }
+    }
+    return strbuf_write(&out, out_fd) == 0 ? 0 : 1;
+}
+
+// Resuming a job in the foreground
+int builtin_fg(Shell *shell, int argc, char **argv, int out_fd){
+    Job *job = job_parse(shell, argc > 1 ? argv[1] : NULL);
+    if (job == NULL) {
+        dprintf(STDERR_FILENO, "fg: %s: no such job\n", argc > 1 ? argv[1] : "current");
+        return 1;
+    }
+    dprintf(out_fd, "%s\n", job -> text);
+    job_continue(shell, job);
+    if (shell -> async && job -> running > 0) { // The server goes on with the line of the session once the job is done
+        shell -> waiting = job;
+        return 0;
+    }
+    job_foreground(shell, job);
+    return shell -> last_status;
+}
+
+// Resuming a stopped job in the background
+int builtin_bg(Shell *shell, int argc, char **argv, int out_fd){
+    Job *job = job_parse(shell, argc > 1 ? argv[1] : NULL);
+    if (job == NULL) {
+        dprintf(STDERR_FILENO, "bg: %s: no such job\n", argc > 1 ? argv[1] : "current");
+        return 1;
+    }
+    job_continue(shell, job);
+    dprintf(out_fd, "[%d] %s &\n", job -> id, job -> text);
+    return 0;
+}
+
+// Waiting for the given jobs, or for all of them
+int builtin_wait(Shell *shell, int argc, char **argv, int out_fd){
+    (void)out_fd;
+    int status = 0;
+    if (shell -> async) { // The server must not block, the line of the session goes on once a running job is done
+        int jobs = argc == 1 ? shell -> job_count : argc - 1;
+        for (int i = 0; i < jobs; i++) {
+            Job *job = argc == 1 ? shell -> jobs[i] : job_parse(shell, argv[i + 1]);
+            if (job != NULL && job -> running > 0) {
+                shell -> waiting = job;
+                shell -> wait_again = 1;
+                return 0;
+            }
+        }
+    }
+    if (argc == 1) {
+        for (int i = 0; i < shell -> job_count; i++) {
+            if (shell -> jobs[i] != NULL) {
+                job_wait(shell, shell -> jobs[i]);
+            }
+        }
+        return 0;
+    }
+    for (int i = 1; i < argc; i++) {
+        Job *job = job_parse(shell, argv[i]);
+        if (job == NULL) {
+            dprintf(STDERR_FILENO, "wait: %s: no such job\n", argv[i]);
+            status = 127;
+            continue;
+        }
+        job_wait(shell, job);
+        status = job -> status;
+    }
+    return status;
+}
+
+// The signals 'kill' knows by name
+static const struct{
+    const char *name;
+    int sig;
+}signal_names[] = {
+    {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL}, {"USR1", SIGUSR1}, {"USR2", SIGUSR2},
+    {"PIPE", SIGPIPE}, {"ALRM", SIGALRM}, {"TERM", SIGTERM}, {"CHLD", SIGCHLD}, {"CONT", SIGCONT},
+    {"STOP", SIGSTOP}, {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU},
+};
+
+// A method to read a signal given as a number or a name, returns -1 if it is unknown
+int parse_signal(const char *name){
+    if (isdigit((unsigned char)name[0])) {
+        return atoi(name);
+    }
+    if (strncmp(name, "SIG", 3) == 0) {
+        name += 3;
+    }
+    for (size_t i = 0; i < sizeof(signal_names) / sizeof(signal_names[0]); i++) {
+        if (strcmp(signal_names[i].name, name) == 0) {
+            return signal_names[i].sig;
+        }
+    }
+    return -1;
+}
+
+// Sending a signal to jobs or pids, 'kill [-signal] %n|pid...'
+int builtin_kill(Shell *shell, int argc, char **argv, int out_fd){
+    (void)out_fd;
+    int sig = SIGTERM, i = 1, status = 0;
+    if (argc > 1 && argv[1][0] == '-') {
+        sig = parse_signal(argv[1] + 1);
+        if (sig < 0) {
+            dprintf(STDERR_FILENO, "kill: %s: invalid signal\n", argv[1] + 1);
+            return 1;
+        }
+        i++;
+    }
+    if (i >= argc) {
+        dprintf(STDERR_FILENO, "kill: usage: kill [-signal] %%n|pid...\n");
+        return 2;
+    }
+    for (; i < argc; i++) {
+        if (argv[i][0] == '%') {
+            Job *job = job_parse(shell, argv[i]);
+            if (job == NULL) {
+                dprintf(STDERR_FILENO, "kill: %s: no such job\n", argv[i]);
+                status = 1;
+                continue;
+            }
+            job_signal(job, sig);
+        } else if (kill(atoi(argv[i]), sig) == -1) {
+            dprintf(STDERR_FILENO, "kill: %s: %s\n", argv[i], strerror(errno));
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// Not allowing the use of the 'cd' command
+int builtin_cd(Shell *shell, int argc, char **argv, int out_fd){
+    (void)shell, (void)argc, (void)argv;
+    dprintf(out_fd, "cd not supported\n");
+    return 1;
+}
+
+// A method to remove variables, an inherited one leaves the environment of the children too
+int builtin_unset(Shell *shell, int argc, char **argv, int out_fd){
+    (void)out_fd;
+    for (int i = 1; i < argc; i++) {
+        var_unset(&shell -> vars, argv[i]);
+        if (!shell -> vars.local) { // The environment the shell started with is not in the table
+            unsetenv(argv[i]);
+        }
+        variable_changed(shell, argv[i]);
+    }
+    return 0;
+}
+
+// A method to export variables to the children, or to list the exported ones
+int builtin_export(Shell *shell, int argc, char **argv, int out_fd){
+    for (int i = 1; i < argc; i++) {
+        char *equals = strchr(argv[i], '=');
+        if (equals != NULL) { // 'export name=value' sets the variable before exporting it
+            *equals = '\0';
+            var_set(&shell -> vars, argv[i], equals + 1);
+        }
+        var_export(&shell -> vars, argv[i]);
+        variable_changed(shell, argv[i]);
+    }
+    if (argc == 1) { // 'export' with no arguments prints the exported variables
+        VarTable *table = &shell -> vars;
+        StrBuf out;
+        strbuf_init(&out, &shell -> arena, 256);
+        for (size_t i = 0; i < table -> capacity; i++) {
+            VarEntry *slot = &table -> slots[i];
+            if (slot -> name != NULL && slot -> name != VAR_TOMBSTONE && slot -> exported) {
+                strbuf_printf(&out, "export %s=\"%s\"\n", slot -> name, slot -> value);
+            }
+        }
+        strbuf_write(&out, out_fd);
+    }
+    return 0;
+}
+
+// Listing the cached paths, 'hash name' adds a command and 'hash -r' forgets them all
+int builtin_hash(Shell *shell, int argc, char **argv, int out_fd){
+    if (argc > 1 && strcmp(argv[1], "-r") == 0) { // A session of a server stops sharing the cache, like for a PATH
+        shell -> path_cache = &shell -> own_path_cache;
+        var_free(shell -> path_cache);
+        return 0;
+    }
+    VarTable *cache = shell -> path_cache;
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+        int cached;
+        if (resolve_command(shell, argv[i], &cached) == NULL) {
+            dprintf(STDERR_FILENO, "hash: %s: not found\n", argv[i]);
+            status = 1;
+        }
+    }
+    if (argc == 1) {
+        StrBuf out;
+        strbuf_init(&out, &shell -> arena, 256);
+        for (size_t i = 0; i < cache -> capacity; i++) {
+            VarEntry *slot = &cache -> slots[i];
+            if (slot -> name != NULL && slot -> name != VAR_TOMBSTONE) {
+                strbuf_printf(&out, "%s\t%s\n", slot -> name, slot -> value);
+            }
+        }
+        strbuf_write(&out, out_fd);
+    }
+    return status;
+}
+
+// Listing the history with the number of each line, 'history n' lists the last n lines and 'history -s prefix'
+// the lines that start with the prefix, the newest first
+int builtin_history(Shell *shell, int argc, char **argv, int out_fd){
+    History *history = &shell -> history;
+    history_index(history);
+    StrBuf out;
+    strbuf_init(&out, &shell -> arena, 4096);
+    if (argc == 3 && strcmp(argv[1], "-s") == 0) { // The lines under the node of the prefix, sorted once
+        long node = history_prefix_node(history, argv[2], strlen(argv[2]));
+        size_t count = node >= 0 ? history_collect(history, node, NULL) : 0;
+        uint32_t *ids = arena_alloc(&shell -> arena, count * sizeof(uint32_t) + 1);
+        if (count > 0) {
+            history_collect(history, node, ids);
+            qsort(ids, count, sizeof(uint32_t), history_newest_first);
+        }
+        for (size_t i = 0; i < count; i++) {
+            HistoryLine *line = &history -> lines[ids[i]];
+            strbuf_printf(&out, "%5lu  %.*s\n", (unsigned long)ids[i] + 1, (int)line -> length, line -> text);
+        }
+        return strbuf_write(&out, out_fd) == 0 ? 0 : 1;
+    }
+    if (argc > 2 || (argc == 2 && !isdigit((unsigned char)argv[1][0]))) {
+        dprintf(STDERR_FILENO, "history: usage: history [n] | history -s prefix\n");
+        return 2;
+    }
+    size_t first = 0;
+    if (argc == 2 && (size_t)atol(argv[1]) < history -> count) {
+        first = history -> count - atol(argv[1]);
+    }
+    for (size_t i = first; i < history -> count; i++) {
+        strbuf_printf(&out, "%5zu  %.*s\n", i + 1, (int)history -> lines[i].length, history -> lines[i].text);
+    }
+    return strbuf_write(&out, out_fd) == 0 ? 0 : 1;
+}
+
+// A method to start the JSON lines log of the timings, or to stop it when the path is NULL. Returns 0 on success
+int stats_open_log(Shell *shell, const char *path){
+    if (shell -> stats_fd >= 0) {
+        close(shell -> stats_fd);
+        shell -> stats_fd = -1;
+    }
+    if (path == NULL) {
+        return 0;
+    }
+    shell -> stats_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (shell -> stats_fd < 0) {
+        dprintf(STDERR_FILENO, "stats: can not open %s\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+// Timing every pipeline, 'stats on' prints the timing of each one like 'time' does and 'stats log file' appends
+// it to a file as JSON lines, 'stats log' alone stops the log
+int builtin_stats(Shell *shell, int argc, char **argv, int out_fd){
+    if (argc == 1) {
+        StrBuf out;
+        strbuf_init(&out, &shell -> arena, 64);
+        strbuf_printf(&out, "stats %s, log %s\n", shell -> stats ? "on" : "off", shell -> stats_fd >= 0 ? "on" : "off");
+        return strbuf_write(&out, out_fd) == 0 ? 0 : 1;
+    }
+    if (strcmp(argv[1], "on") == 0 || strcmp(argv[1], "off") == 0) {
+        shell -> stats = strcmp(argv[1], "on") == 0;
+        return 0;
+    }
+    if (strcmp(argv[1], "log") == 0 && argc <= 3) {
+        return stats_open_log(shell, argc == 3 ? argv[2] : NULL);
+    }
+    dprintf(STDERR_FILENO, "stats: usage: stats [on|off|log [file]]\n");
+    return 2;
+}
+
+// A method to get a setting of 'memo', a shell variable hides the environment
+const char *memo_setting(Shell *shell, const char *name){
+    const char *value = var_get(&shell -> vars, name);
+    if (value == NULL) {
+        value = getenv(name);
+    }
+    return value != NULL && *value != '\0' ? value : NULL;
+}
+
+// A method to get the size limit of the cache of 'memo' from $MEMO_MAX_SIZE, a number of bytes with an optional
+// K, M or G
+long long memo_max_size(Shell *shell){
+    const char *value = memo_setting(shell, "MEMO_MAX_SIZE");
+    if (value == NULL) {
+        return MEMO_MAX_SIZE;
+    }
+    char *end;
+    long long size = strtoll(value, &end, 10);
+    switch (*end) {
+        case 'G': case 'g': size <<= 10; // Fall through
+        case 'M': case 'm': size <<= 10; // Fall through
+        case 'K': case 'k': size <<= 10;
+    }
+    return size > 0 ? size : MEMO_MAX_SIZE;
+}
+
+// An entry of the cache of 'memo' as found in its directory
+typedef struct memo_entry{
+    char *name; // In the arena
+    long long size;
+    struct timespec used; // The mtime of the file, a hit touches it
+}MemoEntry;
+
+// A method to list the entries of the cache of 'memo', the files that are still being written start with '.'.
+// Returns their total size and, when entries is not NULL, the entries in the arena.
+long long memo_scan(Shell *shell, MemoEntry **entries, int *count){
+    long long total = 0;
+    int capacity = 0;
+    if (entries != NULL) {
+        *entries = NULL;
+        *count = 0;
+    }
+    DIR *dir = opendir(shell -> memo.dir);
+    if (dir == NULL) {
+        return 0;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat st;
+        if (entry -> d_name[0] == '.' || fstatat(dirfd(dir), entry -> d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+            !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        total += st.st_size;
+        if (entries == NULL) {
+            continue;
+        }
+        *entries = arena_reserve(&shell -> arena, *entries, *count, &capacity, sizeof(MemoEntry));
+        MemoEntry *memo_entry = &(*entries)[(*count)++];
+        size_t length = strlen(entry -> d_name);
+        memo_entry -> name = arena_alloc(&shell -> arena, length + 1);
+        memcpy(memo_entry -> name, entry -> d_name, length + 1);
+        memo_entry -> size = st.st_size;
+        memo_entry -> used = st.st_mtim;
+    }
+    closedir(dir);
+    return total;
+}
+
+// A method to find the directory of the cache of 'memo': $MEMO_DIR, $XDG_CACHE_HOME/shell-memo or
+// ~/.cache/shell-memo. It is created if needed and its size is counted whenever it changes. Returns 0 on success
+int memo_open(Shell *shell){
+    MemoCache *memo = &shell -> memo;
+    const char *dir = memo_setting(shell, "MEMO_DIR"), *cache = memo_setting(shell, "XDG_CACHE_HOME");
+    const char *home = memo_setting(shell, "HOME");
+    StrBuf path;
+    strbuf_init(&path, &shell -> arena, 256);
+    if (dir != NULL) {
+        strbuf_printf(&path, "%s", dir);
+    } else if (cache != NULL) {
+        mkdir(cache, 0700);
+        strbuf_printf(&path, "%s/shell-memo", cache);
+    } else if (home != NULL) {
+        strbuf_printf(&path, "%s/.cache", home);
+        mkdir(path.data, 0700);
+        strbuf_printf(&path, "/shell-memo");
+    } else {
+        dprintf(STDERR_FILENO, "memo: set MEMO_DIR or HOME\n");
+        return -1;
+    }
+    if (memo -> dir != NULL && strcmp(memo -> dir, path.data) == 0) {
+        return 0;
+    }
+    if (mkdir(path.data, 0700) < 0 && errno != EEXIST) {
+        dprintf(STDERR_FILENO, "memo: can not create %s\n", path.data);
+        return -1;
+    }
+    free(memo -> dir);
+    memo -> dir = strdup(path.data);
+    if (memo -> dir == NULL) {
+        printf("ERR\n");
+        exit(1);
+    }
+    memo -> size = memo_scan(shell, NULL, NULL);
+    return 0;
+}
+
+// A method to order the entries of the cache from the least recently used
+int memo_entry_compare(const void *a, const void *b){
+    const struct timespec *x = &((const MemoEntry *)a) -> used, *y = &((const MemoEntry *)b) -> used;
+    if (x -> tv_sec != y -> tv_sec) {
+        return x -> tv_sec < y -> tv_sec ? -1 : 1;
+    }
+    return (x -> tv_nsec > y -> tv_nsec) - (x -> tv_nsec < y -> tv_nsec);
+}
+
+// A method to keep the cache of 'memo' under its size limit. Once it is over, the least recently used entries are
+// removed until it is down to 90% of the limit, so the directory is not listed again on every new entry. With
+// keep_none every entry is removed.
+void memo_evict(Shell *shell, int keep_none){
+    MemoCache *memo = &shell -> memo;
+    long long limit = memo_max_size(shell);
+    if (!keep_none && memo -> size <= limit) {
+        return;
+    }
+    MemoEntry *entries;
+    int count;
+    memo -> size = memo_scan(shell, &entries, &count); // Other shells may have added or removed entries
+    long long target = keep_none ? 0 : limit / 10 * 9;
+    if (memo -> size <= target && !keep_none) {
+        return;
+    }
+    qsort(entries, count, sizeof(MemoEntry), memo_entry_compare);
+    int dir_fd = open(memo -> dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        return;
+    }
+    for (int i = 0; i < count && memo -> size > target; i++) {
+        if (unlinkat(dir_fd, entries[i].name, 0) == 0) {
+            memo -> size -= entries[i].size;
+            memo -> evictions += !keep_none;
+        }
+    }
+    close(dir_fd);
+}
+
+// 'memo --stats' prints how often the cache was hit and how big it is, 'memo --clear' empties it. A 'memo'
+// prefix with a command never gets here, on a miss its output shows up only once the pipeline exits.
+int builtin_memo(Shell *shell, int argc, char **argv, int out_fd){
+    if (argc != 2 || (strcmp(argv[1], "--stats") != 0 && strcmp(argv[1], "--clear") != 0)) {
+        dprintf(STDERR_FILENO, "memo: usage: memo command | memo --stats | memo --clear\n");
+        return 2;
+    }
+    if (memo_open(shell) != 0) {
+        return 1;
+    }
+    MemoCache *memo = &shell -> memo;
+    if (strcmp(argv[1], "--clear") == 0) {
+        memo_evict(shell, 1);
+        return 0;
+    }
+    MemoEntry *entries;
+    int count;
+    memo -> size = memo_scan(shell, &entries, &count);
+    long lookups = memo -> hits + memo -> misses;
+    StrBuf out;
+    strbuf_init(&out, &shell -> arena, 256);
+    strbuf_printf(&out, "hits %ld, misses %ld, hit rate %.1f%%, bypassed %ld\n", memo -> hits, memo -> misses,
+                  lookups > 0 ? 100.0 * memo -> hits / lookups : 0.0, memo -> bypassed);
+    strbuf_printf(&out, "stored %ld, evicted %ld, replayed %lld bytes\n", memo -> stores, memo -> evictions,
+                  memo -> replayed);
+    strbuf_printf(&out, "%s: %d entries, %.1f KB of %.1f KB\n", memo -> dir, count, memo -> size / 1024.0,
+                  memo_max_size(shell) / 1024.0);
+    return strbuf_write(&out, out_fd) == 0 ? 0 : 1;
+}
+
+// A method to read a number of the topology of a CPU from sysfs, -1 if it is not there
+int read_cpu_topology(int cpu, const char *name){
+    char path[128], value[32];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = read(fd, value, sizeof(value) - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    value[n] = '\0';
+    return atoi(value);
+}
+
+// A CPU and where it sits, to order the CPUs for 'sched -c auto'
+typedef struct cpu_place{
+    int cpu;
+    int thread; // 0 for the first CPU of its core, 1 for the next thread of the same core and so on
+    int package;
+    int core;
+}CpuPlace;
+
+// A method to compare two CPUs for qsort: every core before a second thread of a core, and the cores of a
+// package next to each other
+int cpu_place_compare(const void *a, const void *b){
+    const CpuPlace *x = a, *y = b;
+    if (x -> thread != y -> thread) {
+        return x -> thread - y -> thread;
+    }
+    if (x -> package != y -> package) {
+        return x -> package - y -> package;
+    }
+    if (x -> core != y -> core) {
+        return x -> core - y -> core;
+    }
+    return x -> cpu - y -> cpu;
+}
+
+// A method to order the CPUs the shell may run on for 'sched -c auto', once. The stages of a pipeline get CPUs
+// of distinct cores, on one package while it has free cores, and the threads of a core only come after that.
+void sched_order_cpus(Shell *shell){
+    if (shell -> sched_cpus != NULL) {
+        return;
+    }
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        CPU_ZERO(&allowed);
+        CPU_SET(0, &allowed);
+    }
+    int count = CPU_COUNT(&allowed);
+    CpuPlace *places = malloc(count * sizeof(CpuPlace));
+    shell -> sched_cpus = malloc(count * sizeof(int));
+    if (places == NULL || shell -> sched_cpus == NULL) {
+        printf("ERR\n");
+        exit(1);
+    }
+    int n = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && n < count; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        CpuPlace *place = &places[n++];
+        place -> cpu = cpu;
+        place -> package = read_cpu_topology(cpu, "physical_package_id");
+        place -> core = read_cpu_topology(cpu, "core_id");
+        if (place -> core < 0) { // No topology, every CPU is a core of its own
+            place -> core = cpu;
+        }
+        place -> thread = 0;
+        for (int i = 0; i < n - 1; i++) {
+            place -> thread += places[i].package == place -> package && places[i].core == place -> core;
+        }
+    }
+    qsort(places, n, sizeof(CpuPlace), cpu_place_compare);
+    for (int i = 0; i < n; i++) {
+        shell -> sched_cpus[i] = places[i].cpu;
+    }
+    shell -> sched_cpu_count = n;
+    free(places);
+}
+
+// A method to read a list of CPUs like '0-3,8', returns -1 if it is not one
+int parse_cpu_list(const char *list, cpu_set_t *cpus){
+    CPU_ZERO(cpus);
+    while (1) {
+        char *end;
+        long low = strtol(list, &end, 10), high = low;
+        if (end == list || low < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            high = strtol(list, &end, 10);
+            if (end == list || high < low) {
+                return -1;
+            }
+        }
+        if (high >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = low; cpu <= high; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+        if (*end == '\0') {
+            return 0;
+        }
+        if (*end != ',') {
+            return -1;
+        }
+        list = end + 1;
+    }
+}
+
+// A method to read the options of a 'sched' prefix into sched: '-c cpus' or '-c auto', '-n nice' and
+// '-i class[:level]'. Returns the number of words they take, with 'sched' itself, or -1 with an error printed.
+// Every 'auto' takes the next CPU of the order of sched_order_cpus, so the stages of a pipeline get distinct ones.
+int parse_sched(Shell *shell, int argc, char **argv, SpawnSched *sched){
+    static const char *io_classes[] = {"none", "realtime", "best-effort", "idle"};
+    memset(sched, 0, sizeof(*sched));
+    sched -> ioprio = -1;
+    int i = 1;
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        const char *value = argv[i + 1];
+        if (strcmp(argv[i], "-c") == 0 && strcmp(value, "auto") == 0) {
+            sched_order_cpus(shell);
+            CPU_ZERO(&sched -> cpus);
+            CPU_SET(shell -> sched_cpus[shell -> sched_next++ % shell -> sched_cpu_count], &sched -> cpus);
+            sched -> has_cpus = 1;
+        } else if (strcmp(argv[i], "-c") == 0 && parse_cpu_list(value, &sched -> cpus) == 0) {
+            sched -> has_cpus = 1;
+        } else if (strcmp(argv[i], "-n") == 0 && (isdigit((unsigned char)value[value[0] == '-']))) {
+            sched -> nice = atoi(value);
+            sched -> has_nice = 1;
+        } else if (strcmp(argv[i], "-i") == 0) {
+            size_t length = strcspn(value, ":");
+            int class = 1, level = value[length] == ':' ? atoi(value + length + 1) : 4;
+            while (class < 4 && (strncmp(io_classes[class], value, length) != 0 || length == 0)) {
+                class++;
+            }
+            if (class == 4 || level < 0 || level > 7) {
+                break;
+            }
+            sched -> ioprio = SPAWN_IOPRIO(class, class == 3 ? 0 : level); // The idle class has no levels
+        } else {
+            break;
+        }
+    }
+    if (i < argc && argv[i][0] == '-') {
+        dprintf(STDERR_FILENO, "sched: usage: sched [-c cpus|auto] [-n nice] [-i realtime|best-effort|idle[:level]] command\n");
+        return -1;
+    }
+    return i;
+}
+
+// Listing the order the CPUs are given out in by 'sched -c auto', a 'sched' prefix with a command never gets here
+int builtin_sched(Shell *shell, int argc, char **argv, int out_fd){
+    SpawnSched sched;
+    if (argc > 1) {
+        if (parse_sched(shell, argc, argv, &sched) >= 0) {
+            dprintf(STDERR_FILENO, "sched: no command\n");
+        }
+        return 2;
+    }
+    sched_order_cpus(shell);
+    StrBuf out;
+    strbuf_init(&out, &shell -> arena, 64);
+    strbuf_printf(&out, "auto cpus:");
+    for (int i = 0; i < shell -> sched_cpu_count; i++) {
+        strbuf_printf(&out, " %d", shell -> sched_cpus[i]);
+    }
+    strbuf_printf(&out, "\n");
+    return strbuf_write(&out, out_fd) == 0 ? 0 : 1;
+}
+
+// Printing the arguments with spaces between them, '-n' leaves out the new line
+int builtin_echo(Shell *shell, int argc, char **argv, int out_fd){
+    int newline = 1, i = 1;
+    if (argc > 1 && strcmp(argv[1], "-n") == 0) { // '-n' leaves out the new line
+        newline = 0;
+        i++;
+    }
+    StrBuf out;
+    strbuf_init(&out, &shell -> arena, 64);
+    for (int first = i; i < argc; i++) {
+        if (i > first) {
+            strbuf_append(&out, " ", 1);
+        }
+        strbuf_append(&out, argv[i], strlen(argv[i]));
+    }
+    if (newline) {
+        strbuf_append(&out, "\n", 1);
+    }
+    return strbuf_write(&out, out_fd) == 0 ? 0 : 1;
+}
+
+// Printing the current directory
+int builtin_pwd(Shell *shell, int argc, char **argv, int out_fd){
+    (void)shell, (void)argc, (void)argv;
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        dprintf(STDERR_FILENO, "Error with 'getcwd()' function\n");
+        return 1;
+    }
+    int status = dprintf(out_fd, "%s\n", cwd) < 0 ? 1 : 0;
+    free(cwd);
+    return status;
+}
+
+// Doing nothing and succeeding
+int builtin_true(Shell *shell, int argc, char **argv, int out_fd){
+    (void)shell, (void)argc, (void)argv, (void)out_fd;
+    return 0;
+}
+
+// Doing nothing and failing
+int builtin_false(Shell *shell, int argc, char **argv, int out_fd){
+    (void)shell, (void)argc, (void)argv, (void)out_fd;
+    return 1;
+}
+
+// A method to add the char of a backslash escape of a printf format, returns the last char it used
+const char *append_escape(StrBuf *out, const char *p){
+    static const char escapes[] = "n\nt\tr\ra\ab\bf\fv\v\\\\\"\"''";
+    char c = p[1];
+    if (c == '\0') { // A backslash at the end stays as it is
+        strbuf_append(out, "\\", 1);
+        return p;
+    }
+    if (c >= '0' && c <= '7') { // Up to three octal digits
+        int value = 0, digits = 0;
+        while (digits < 3 && p[1] >= '0' && p[1] <= '7') {
+            value = value * 8 + (*++p - '0');
+            digits++;
+        }
+        char byte = (char)value;
+        strbuf_append(out, &byte, 1);
+        return p;
+    }
+    for (int i = 0; escapes[i] != '\0'; i += 2) {
+        if (escapes[i] == c) {
+            strbuf_append(out, &escapes[i + 1], 1);
+            return p + 1;
+        }
+    }
+    strbuf_append(out, p, 2); // An unknown escape is kept with its backslash
+    return p + 1;
+}
+
+// The format is used again while there are arguments left, like the printf program does
+int builtin_printf(Shell *shell, int argc, char **argv, int out_fd){
+    if (argc < 2) {
+        dprintf(STDERR_FILENO, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+    StrBuf out;
+    strbuf_init(&out, &shell -> arena, 64);
+    const char *format = argv[1];
+    int arg = 2, used;
+    do {
+        used = arg;
+        for (const char *p = format; *p != '\0'; p++) {
+            if (*p == '\\') {
+                p = append_escape(&out, p);
+                continue;
+            }
+            if (*p != '%') {
+                strbuf_append(&out, p, 1);
+                continue;
+            }
+            if (p[1] == '%') {
+                strbuf_append(&out, "%", 1);
+                p++;
+                continue;
+            }
+            // Copying the conversion so snprintf can do the formatting
+            const char *start = p++;
+            while (*p != '\0' && strchr("-+ #0", *p) != NULL) {
+                p++;
+            }
+            while (isdigit((unsigned char)*p)) {
+                p++;
+            }
+            if (*p == '.') {
+                p++;
+                while (isdigit((unsigned char)*p)) {
+                    p++;
+                }
+            }
+            char spec[32];
+            size_t spec_len = p - start;
+            if (*p == '\0' || strchr("sbcdiuxXofeEgG", *p) == NULL || spec_len + 4 > sizeof(spec)) {
+                strbuf_append(&out, start, p - start + (*p != '\0')); // Not a conversion we know, keeping it as it is
+                if (*p == '\0') {
+                    break;
+                }
+                continue;
+            }
+            memcpy(spec, start, spec_len);
+            const char *value = arg < argc ? argv[arg++] : "";
+            switch (*p) {
+                case 'd':
+                case 'i':
+                    memcpy(spec + spec_len, "ll", 2);
+                    spec[spec_len + 2] = *p;
+                    spec[spec_len + 3] = '\0';
+                    strbuf_printf(&out, spec, strtoll(value, NULL, 0));
+                    break;
+                case 'u':
+                case 'x':
+                case 'X':
+                case 'o':
+                    memcpy(spec + spec_len, "ll", 2);
+                    spec[spec_len + 2] = *p;
+                    spec[spec_len + 3] = '\0';
+                    strbuf_printf(&out, spec, strtoull(value, NULL, 0));
+                    break;
+                case 'f':
+                case 'e':
+                case 'E':
+                case 'g':
+                case 'G':
+                    spec[spec_len] = *p;
+                    spec[spec_len + 1] = '\0';
+                    strbuf_printf(&out, spec, strtod(value, NULL));
+                    break;
+                case 'c':
+                    if (value[0] != '\0') {
+                        strbuf_append(&out, value, 1);
+                    }
+                    break;
+                default: // '%s' and '%b'
+                    spec[spec_len] = 's';
+                    spec[spec_len + 1] = '\0';
+                    strbuf_printf(&out, spec, value);
+                    break;
+            }
+        }
+    } while (arg < argc && arg > used);
+    return strbuf_write(&out, out_fd) == 0 ? 0 : 1;
+}
+
+// The builtin dispatch table
+static const Builtin builtins[] = {
+    {"echo", builtin_echo, BUILTIN_PIPEABLE},
+    {"printf", builtin_printf, BUILTIN_PIPEABLE},
+    {"pwd", builtin_pwd, BUILTIN_PIPEABLE},
+    {"true", builtin_true, BUILTIN_PIPEABLE},
+    {"false", builtin_false, BUILTIN_PIPEABLE},
+    {"jobs", builtin_jobs, 0},
+    {"fg", builtin_fg, 0},
+    {"bg", builtin_bg, 0},
+    {"wait", builtin_wait, 0},
+    {"kill", builtin_kill, 0},
+    {"cd", builtin_cd, 0},
+    {"unset", builtin_unset, 0},
+    {"export", builtin_export, 0},
+    {"hash", builtin_hash, 0},
+    {"stats", builtin_stats, 0},
+    {"history", builtin_history, BUILTIN_PIPEABLE},
+    {"sched", builtin_sched, 0},
+    {"memo", builtin_memo, 0},
+};
+
+// A method to find a builtin by its name, NULL if the command is not a builtin
+const Builtin *find_builtin(const char *name){
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(builtins[i].name, name) == 0) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+// A method to run a builtin inside the shell, a reader that went away must not kill the shell with SIGPIPE.
+// The errors of the builtin go to err_fd while it runs.
+int run_builtin_stage(Shell *shell, const Builtin *builtin, int argc, char **argv, int out_fd, int err_fd){
+    sigset_t pipe_set, old;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipe_set, &old);
+    fflush(stdout); // So our buffered output comes before the output of the builtin
+    int saved_err = -1;
+    if (err_fd != STDERR_FILENO) {
+        saved_err = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(err_fd, STDERR_FILENO);
+    }
+    int status = builtin -> run(shell, argc, argv, out_fd);
+    if (saved_err >= 0) {
+        dup2(saved_err, STDERR_FILENO);
+        close(saved_err);
+    }
+    struct timespec no_wait = {0, 0};
+    while (sigtimedwait(&pipe_set, NULL, &no_wait) > 0); // Dropping the SIGPIPE the write raised
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return status;
+}
+
+// A method to get the length of the parameter name at p, '?' and '$' are names too. Returns 0 if there is none.
+size_t param_name_length(const char *p){
+    if (*p == '?' || *p == '$') {
+        return 1;
+    }
+    if (!isalpha((unsigned char)*p) && *p != '_') {
+        return 0;
+    }
+    size_t length = 1;
+    while (isalnum((unsigned char)p[length]) || p[length] == '_') {
+        length++;
+    }
+    return length;
+}
+
+// A method to get the value of a parameter: '?' is the exit code of the last pipeline, '$' the pid of the shell
+// and any other name a variable. Returns NULL if the variable is not set.
+const char *param_value(Shell *shell, const char *name, size_t length){
+    if (length == 1 && (name[0] == '?' || name[0] == '$')) {
+        snprintf(shell -> number, sizeof(shell -> number), "%d", name[0] == '?' ? shell -> last_status : (int)shell -> pid);
+        return shell -> number;
+    }
+    return var_lookup(&shell -> vars, name, length);
+}
+
+// A method to append a parameter to the output, 'rest' is how many raw chars are still to be copied after it.
+// With 'escape' the chars that are special to a glob pattern get a '\\', so a value is never a pattern.
+void expand_append(StrBuf *out, const char *value, size_t rest, int escape){
+    size_t length = strlen(value);
+    if (!escape) {
+        strbuf_reserve(out, length + rest);
+        strbuf_append(out, value, length);
+        return;
+    }
+    strbuf_reserve(out, 2 * length + rest);
+    for (; *value != '\0'; value++) {
+        if (strchr("*?[]\\", *value) != NULL) {
+            out -> data[out -> length++] = '\\';
+        }
+        out -> data[out -> length++] = *value;
+    }
+    out -> data[out -> length] = '\0';
+}
+
+// A method to expand the raw chars from p to end into out and remove their quotes, 'quote' is the quote the chars
+// start in. '$NAME', '${NAME}', '${NAME:-default}' and '${NAME-default}' are expanded, a '$' that starts none of
+// them is kept as it is. Every char is looked at once and the output always has room for the raw chars that are
+// left, 'tail' of them after 'end', so the plain chars are copied without any checks and the cost is linear in
+// the size of the output. With 'glob' the output is a glob pattern: the quoted and escaped chars, and the values
+// of the parameters, get a '\\' before the chars that are special to a pattern. A 'quote' of '\n' expands the
+// body of a here-document, where the quotes are plain chars and only '\\', '$' and '`' can be escaped.
+void expand_range(Shell *shell, StrBuf *out, const char *p, const char *end, char quote, size_t tail, int glob){
+    for (; p < end; p++) {
+        int literal = quote != 0; // A quoted or escaped char is never special to a pattern
+        if ((*p == '"' || *p == '\'') && (quote == 0 || quote == *p)) { // Removing the quotes
+            quote = quote == 0 ? *p : 0;
+            continue;
+        }
+        if (*p == '\\' && p + 1 < end && (quote == 0 || (quote == '"' && strchr("\\\"$`", p[1]) != NULL) ||
+                                          (quote == '\n' && strchr("\\$`", p[1]) != NULL))) {
+            p++; // Taking the escaped char as it is, inside double quotes only the special chars can be escaped
+            literal = 1;
+        } else if (*p == '$' && quote != '\'' && p[1] == '{') {
+            const char *close = find_brace_end(p + 2);
+            const char *name = p + 2;
+            size_t name_len = param_name_length(name);
+            const char *op = name + name_len; // What follows the name, the '}' or the default
+            if (close != NULL && close < end && name_len > 0 &&
+                (op == close || op[0] == '-' || (op[0] == ':' && op[1] == '-'))) {
+                const char *value = param_value(shell, name, name_len);
+                size_t rest = (end - close - 1) + tail;
+                if (op == close || (value != NULL && (op[0] == '-' || value[0] != '\0'))) {
+                    if (value != NULL) { // An unset variable expands to nothing
+                        expand_append(out, value, rest, glob);
+                    }
+                } else { // ':-' takes the default when the variable is unset or empty, '-' only when it is unset
+                    expand_range(shell, out, op + (op[0] == ':' ? 2 : 1), close, quote, rest, glob);
+                }
+                p = close;
+                continue;
+            }
+        } else if (*p == '$' && quote != '\'') {
+            size_t name_len = param_name_length(p + 1);
+            if (name_len > 0) {
+                const char *value = param_value(shell, p + 1, name_len);
+                p += name_len;
+                if (value != NULL) {
+                    expand_append(out, value, (end - p - 1) + tail, glob);
+                }
+                continue;
+            }
+        }
+        if (glob && literal && strchr("*?[]\\", *p) != NULL) {
+            strbuf_reserve(out, (end - p) + tail + 1);
+            out -> data[out -> length++] = '\\';
+        }
+        out -> data[out -> length++] = *p;
+    }
+    out -> data[out -> length] = '\0';
+}
+
+// A method to expand a raw word and remove its quotes, the result lives in the arena
+char *expand_word(Shell *shell, const char *raw){
+    size_t length = strlen(raw);
+    StrBuf out;
+    strbuf_init(&out, &shell -> arena, length);
+    expand_range(shell, &out, raw, raw + length, 0, 0, 0);
+    return out.data;
+}
+
+// A piece of a compiled glob pattern
+typedef struct glob_op{
+    char type; // 'l' a run of literal chars, '?' any char, '*' any run of chars, '[' a char of a set
+    const char *text; // The chars of a literal run, without their escapes
+    size_t length;
+    uint64_t set[4]; // The chars of a set, one bit each
+}GlobOp;
+
+// A compiled pattern of one component of a path
+typedef struct glob_matcher{
+    GlobOp *ops;
+    int count;
+    int dot; // Set when the pattern starts with a literal '.', only then it matches the hidden names
+}GlobMatcher;
+
+// A name of a directory listing, it points into the buffer getdents64 filled
+typedef struct glob_entry{
+    const char *name;
+    size_t length;
+    unsigned char type; // The d_type, DT_UNKNOWN when the file system does not tell
+}GlobEntry;
+
+// A directory that was read by a glob, every glob of the same pipeline reuses its listing
+typedef struct glob_dir{
+    const char *path;
+    GlobEntry *entries;
+    int count;
+    struct glob_dir *next;
+}GlobDir;
+
+// The state of the expansion of one glob word
+typedef struct glob_walk{
+    Shell *shell;
+    StrBuf path; // The path of the directory that is read, it grows by a component at each level
+    char **matches;
+    int count;
+    int capacity;
+}GlobWalk;
+
+// A method to compile one component of a glob pattern, the pattern is 'length' chars with '\\' escapes.
+// Returns 1 if the component has a '*', a '?' or a '[...]', 0 if it is only literal chars.
+int glob_compile(Arena *arena, const char *p, size_t length, GlobMatcher *matcher){
+    const char *end = p + length;
+    int capacity = 0, magic = 0;
+    matcher -> ops = NULL;
+    matcher -> count = 0;
+    matcher -> dot = *p == '.' || (*p == '\\' && p[1] == '.');
+    char *literal = arena_alloc(arena, length + 1); // The unescaped chars of all the literal runs
+    GlobOp *op = NULL;
+    while (p < end) {
+        if (*p == '*' || *p == '?' || *p == '[') {
+            GlobOp set;
+            memset(&set, 0, sizeof(set));
+            set.type = *p;
+            const char *q = p + 1;
+            if (*p == '[') { // A set, the chars or ranges up to the ']' that closes it
+                int negate = q < end && (*q == '!' || *q == '^');
+                q += negate;
+                const char *first = q;
+                while (q < end && (*q != ']' || q == first)) {
+                    unsigned char low = *q == '\\' && q + 1 < end ? *++q : *q, high = low;
+                    if (q + 2 < end && q[1] == '-' && q[2] != ']') {
+                        q += 2;
+                        high = *q == '\\' && q + 1 < end ? *++q : *q;
+                    }
+                    for (int c = low; c <= high; c++) {
+                        set.set[c >> 6] |= 1ULL << (c & 63);
+                    }
+                    q++;
+                }
+                if (q == end) { // No ']', so the '[' is a literal char
+                    set.type = 0;
+                } else {
+                    q++;
+                    for (int i = 0; negate && i < 4; i++) {
+                        set.set[i] = ~set.set[i];
+                    }
+                }
+            }
+            if (set.type != 0) {
+                if (!(set.type == '*' && op != NULL && op -> type == '*')) { // '**' is the same as '*'
+                    matcher -> ops = arena_reserve(arena, matcher -> ops, matcher -> count, &capacity, sizeof(GlobOp));
+                    op = &matcher -> ops[matcher -> count++];
+                    *op = set;
+                }
+                magic = 1;
+                p = q;
+                continue;
+            }
+        }
+        if (*p == '\\' && p + 1 < end) {
+            p++;
+        }
+        if (op == NULL || op -> type != 'l') { // Starting a new literal run
+            matcher -> ops = arena_reserve(arena, matcher -> ops, matcher -> count, &capacity, sizeof(GlobOp));
+            op = &matcher -> ops[matcher -> count++];
+            op -> type = 'l';
+            op -> text = literal;
+            op -> length = 0;
+        }
+        *literal++ = *p++;
+        op -> length++;
+    }
+    return magic;
+}
+
+// A method to match a name against a compiled pattern. A '*' that fails to match further on is retried one
+// char later, only the last '*' needs to be retried, so the cost is at most the length of the name times the
+// length of the pattern and usually linear.
+int glob_match(const GlobMatcher *matcher, const char *name, size_t length){
+    if (name[0] == '.' && !matcher -> dot) { // Hidden names only match a pattern that starts with a '.'
+        return 0;
+    }
+    const GlobOp *ops = matcher -> ops;
+    int count = matcher -> count;
+    if (count > 0 && ops[count - 1].type == 'l') { // Most names fail on the suffix of a '*.ext' at once
+        const GlobOp *last = &ops[count - 1];
+        if (last -> length > length || memcmp(name + length - last -> length, last -> text, last -> length) != 0) {
+            return 0;
+        }
+    }
+    int i = 0, star = -1;
+    size_t n = 0, star_n = 0;
+    while (i < count || n < length) {
+        if (i < count) {
+            const GlobOp *op = &ops[i];
+            if (op -> type == '*') {
+                star = i++;
+                star_n = n;
+                continue;
+            }
+            if (op -> type == 'l' && length - n >= op -> length && memcmp(name + n, op -> text, op -> length) == 0) {
+                i++;
+                n += op -> length;
+                continue;
+            }
+            unsigned char c = name[n];
+            if (n < length && (op -> type == '?' || (op -> type == '[' && (op -> set[c >> 6] >> (c & 63) & 1)))) {
+                i++;
+                n++;
+                continue;
+            }
+        }
+        if (star < 0 || star_n >= length) { // Nothing left to retry
+            return 0;
+        }
+        i = star + 1;
+        n = ++star_n;
+    }
+    return 1;
+}
+
+// A method to get the listing of a directory, reading it with getdents64 the first time. The names stay in the
+// buffers the kernel filled. Returns NULL if the directory can not be read.
+GlobDir *glob_read_dir(Shell *shell, const char *path){
+    for (GlobDir *dir = shell -> glob_dirs; dir != NULL; dir = dir -> next) {
+        if (strcmp(dir -> path, path) == 0) {
+            return dir;
+        }
+    }
+    int fd = open(path[0] != '\0' ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    Arena *arena = &shell -> arena;
+    GlobDir *dir = arena_alloc(arena, sizeof(GlobDir));
+    dir -> path = arena_strndup(arena, path, strlen(path));
+    dir -> entries = NULL;
+    dir -> count = 0;
+    int capacity = 0;
+    while (1) {
+        char *buf = arena_alloc(arena, GLOB_READ_CHUNK);
+        ssize_t n = getdents64(fd, buf, GLOB_READ_CHUNK);
+        if (n <= 0) {
+            break;
+        }
+        for (ssize_t offset = 0; offset < n;) {
+            struct dirent64 *entry = (struct dirent64 *)(buf + offset);
+            offset += entry -> d_reclen;
+            const char *name = entry -> d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            dir -> entries = arena_reserve(arena, dir -> entries, dir -> count, &capacity, sizeof(GlobEntry));
+            dir -> entries[dir -> count++] = (GlobEntry){name, strlen(name), entry -> d_type};
+        }
+    }
+    close(fd);
+    dir -> next = shell -> glob_dirs;
+    shell -> glob_dirs = dir;
+    return dir;
+}
+
+// A method to add the paths that match the components of a pattern, starting at the directory in walk -> path
+void glob_walk(GlobWalk *walk, const char *pattern){
+    Arena *arena = &walk -> shell -> arena;
+    size_t base = walk -> path.length;
+    while (*pattern == '/') { // Empty components
+        strbuf_append(&walk -> path, "/", 1);
+        pattern++;
+    }
+    if (*pattern == '\0') { // A pattern that ends with a '/' only matches directories, and we are at one
+        walk -> matches = arena_reserve(arena, walk -> matches, walk -> count, &walk -> capacity, sizeof(char *));
+        walk -> matches[walk -> count++] = arena_strndup(arena, walk -> path.data, walk -> path.length);
+        walk -> path.data[walk -> path.length = base] = '\0';
+        return;
+    }
+    const char *end = pattern;
+    while (*end != '\0' && *end != '/') {
+        end += *end == '\\' && end[1] != '\0' ? 2 : 1;
+    }
+    GlobMatcher matcher;
+    int magic = glob_compile(arena, pattern, end - pattern, &matcher);
+    size_t dir_length = walk -> path.length;
+    if (!magic) { // A literal component is not looked up in the directory, only checked at the end of the path
+        if (matcher.count > 0) {
+            strbuf_append(&walk -> path, matcher.ops[0].text, matcher.ops[0].length);
+        }
+        struct stat st;
+        if (*end != '\0') {
+            glob_walk(walk, end);
+        } else if (lstat(walk -> path.data, &st) == 0) {
+            walk -> matches = arena_reserve(arena, walk -> matches, walk -> count, &walk -> capacity, sizeof(char *));
+            walk -> matches[walk -> count++] = arena_strndup(arena, walk -> path.data, walk -> path.length);
+        }
+        walk -> path.data[walk -> path.length = base] = '\0';
+        return;
+    }
+    GlobDir *dir = glob_read_dir(walk -> shell, walk -> path.data);
+    for (int i = 0; dir != NULL && i < dir -> count; i++) {
+        GlobEntry *entry = &dir -> entries[i];
+        if (!glob_match(&matcher, entry -> name, entry -> length)) {
+            continue;
+        }
+        strbuf_append(&walk -> path, entry -> name, entry -> length);
+        if (*end == '\0') {
+            walk -> matches = arena_reserve(arena, walk -> matches, walk -> count, &walk -> capacity, sizeof(char *));
+            walk -> matches[walk -> count++] = arena_strndup(arena, walk -> path.data, walk -> path.length);
+        } else {
+            struct stat st; // More components follow, so only a directory can match
+            if (entry -> type == DT_DIR || ((entry -> type == DT_LNK || entry -> type == DT_UNKNOWN) &&
+                                            stat(walk -> path.data, &st) == 0 && S_ISDIR(st.st_mode))) {
+                glob_walk(walk, end);
+            }
+        }
+        walk -> path.data[walk -> path.length = dir_length] = '\0';
+    }
+    walk -> path.data[walk -> path.length = base] = '\0';
+}
+
+// A method to compare two paths for qsort
+int glob_compare(const void *a, const void *b){
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// A method to expand a word that may be a glob into the sorted paths that match it, added to argv. A word that
+// matches nothing is kept as it is, without its quotes. Returns the new count of argv.
+int glob_word(Shell *shell, const char *raw, char ***argv, int count, int *capacity){
+    size_t length = strlen(raw);
+    StrBuf pattern;
+    strbuf_init(&pattern, &shell -> arena, length);
+    expand_range(shell, &pattern, raw, raw + length, 0, 0, 1);
+    GlobWalk walk;
+    walk.shell = shell;
+    walk.matches = NULL;
+    walk.count = walk.capacity = 0;
+    strbuf_init(&walk.path, &shell -> arena, 256);
+    const char *p = pattern.data;
+    if (*p == '/') { // An absolute pattern starts at the root
+        strbuf_append(&walk.path, "/", 1);
+        p++;
+    }
+    int magic = 0;
+    for (const char *q = pattern.data; *q != '\0'; q++) {
+        if (*q == '\\' && q[1] != '\0') {
+            q++;
+        } else if (*q == '*' || *q == '?' || *q == '[') {
+            magic = 1;
+            break;
+        }
+    }
+    if (magic) {
+        glob_walk(&walk, p);
+    }
+    char *word = pattern.data;
+    if (walk.count == 0) { // Nothing matched, the word stays, only the escapes of the pattern go away
+        char *out = word;
+        for (const char *q = word; *q != '\0'; q++) {
+            if (*q == '\\' && q[1] != '\0') {
+                q++;
+            }
+            *out++ = *q;
+        }
+        *out = '\0';
+        walk.matches = &word;
+        walk.count = 1;
+    } else {
+        qsort(walk.matches, walk.count, sizeof(char *), glob_compare);
+    }
+    for (int i = 0; i < walk.count; i++) {
+        *argv = arena_reserve(&shell -> arena, *argv, count + 1, capacity, sizeof(char *)); // Room for the NULL
+        (*argv)[count++] = walk.matches[i];
+    }
+    return count;
+}
+
+// A method to expand all the words of a command, a word with an unquoted '*', '?' or '[' becomes the paths that
+// match it. Returns the new argv and sets argc to its length.
+char **expand_command(Shell *shell, Command *command, int *argc){
+    int capacity = command -> argc + 1, count = 0;
+    char **argv = arena_alloc(&shell -> arena, capacity * sizeof(char *));
+    for (int i = 0; i < command -> argc; i++) {
+        const char *raw = command -> argv[i];
+        if (strpbrk(raw, "*?[") == NULL) { // Most words can not be a glob
+            argv = arena_reserve(&shell -> arena, argv, count + 1, &capacity, sizeof(char *));
+            argv[count++] = expand_word(shell, raw);
+        } else {
+            count = glob_word(shell, raw, &argv, count, &capacity);
+        }
+    }
+    argv[count] = NULL;
+    *argc = count;
+    return argv;
+}
+
+// A method to run a command made only of 'name=value' words, returns 0 if it has other words
+int run_assignments(Shell *shell, Command *command){
+    for (int i = 0; i < command -> argc; i++) {
+        if (assignment_name_length(command -> argv[i]) == 0) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < command -> argc; i++) {
+        char *word = command -> argv[i];
+        size_t name_len = assignment_name_length(word);
+        word[name_len] = '\0'; // The raw words belong to this line, so the name can be cut in place
+        var_set(&shell -> vars, word, expand_word(shell, word + name_len + 1));
+        variable_changed(shell, word);
+    }
+    return 1;
+}
+
+// A method to close the files of the redirects of a command
+void close_redirects(int files[3]){
+    for (int i = 0; i < 3; i++) {
+        if (files[i] >= 0) {
+            close(files[i]);
+            files[i] = -1;
+        }
+    }
+}
+
+// A method to get the input of a here-string or a here-document, expanded unless its delimiter was quoted
+char *here_text(Shell *shell, Redirect *redirect, size_t *length){
+    if (redirect -> kind == REDIRECT_HERE_STRING) {
+        char *word = expand_word(shell, redirect -> target);
+        StrBuf text;
+        strbuf_init(&text, &shell -> arena, strlen(word) + 1);
+        strbuf_append(&text, word, strlen(word));
+        strbuf_append(&text, "\n", 1);
+        *length = text.length;
+        return text.data;
+    }
+    char *body = redirect -> doc -> body != NULL ? redirect -> doc -> body : "";
+    *length = strlen(body);
+    if (redirect -> doc -> raw) {
+        return body;
+    }
+    StrBuf text;
+    strbuf_init(&text, &shell -> arena, *length);
+    expand_range(shell, &text, body, body + *length, '\n', 0, 0);
+    *length = text.length;
+    return text.data;
+}
+
+// A method to put the input of a here-string or a here-document into a memfd the command reads like a file.
+// It is written once, before the command starts, so it needs no temporary file and no process to feed it,
+// and it can be bigger than a pipe. Returns the fd, or -1 on an error.
+int open_here(Shell *shell, Redirect *redirect){
+    size_t length;
+    char *text = here_text(shell, redirect, &length);
+    int fd = memfd_create("here", MFD_CLOEXEC);
+    if (fd < 0 || write_all(fd, text, length) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+        printf("Error writing the here-document\n");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// A method to open the files of the redirects of a command, files[fd] gets the file of fd or -1 if fd is not
+// redirected. Returns -1 if a file could not be opened, the others are closed again.
+int open_redirects(Shell *shell, Command *command, int files[3]){
+    files[0] = files[1] = files[2] = -1;
+    for (int i = 0; i < command -> redirect_count; i++) {
+        Redirect *redirect = &command -> redirects[i];
+        int fd;
+        if (redirect -> kind != REDIRECT_FILE) {
+            fd = open_here(shell, redirect);
+        } else {
+            char *path = expand_word(shell, redirect -> target);
+            fd = open(path, redirect -> flags | O_CLOEXEC, 0644);
+            if (fd < 0) {
+                printf("Error opening the file %s\n", path);
+            }
+        }
+        if (fd < 0) {
+            close_redirects(files);
+            return -1;
+        }
+        if (files[redirect -> fd] >= 0) { // The last redirect of an fd wins, the earlier file is only created
+            close(files[redirect -> fd]);
+        }
+        files[redirect -> fd] = fd;
+    }
+    return 0;
+}
+
+// A method to grow a pipe so a fast stage moves more data per wakeup, it keeps its size if the limit is lower
+void grow_pipe(int fd){
+    fcntl(fd, F_SETPIPE_SZ, PIPE_SIZE);
+}
+
+// A method to move length bytes from a pipe into an fd with splice, returns how many of them the fd did not take
+size_t splice_all(int pipe_fd, int fd, size_t length){
+    while (length > 0) {
+        ssize_t n = splice(pipe_fd, NULL, fd, NULL, length, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        length -= n;
+    }
+    return length;
+}
+
+// A method to copy length bytes from a pipe into an fd through a buffer, for the fds splice does not take.
+// An fd of -1 drops the bytes.
+int copy_all(int pipe_fd, int fd, size_t length){
+    char buf[COPY_CHUNK];
+    while (length > 0) {
+        ssize_t n = read(pipe_fd, buf, length < sizeof(buf) ? length : sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0 || (fd >= 0 && write_all(fd, buf, n) < 0)) {
+            return -1;
+        }
+        length -= n;
+    }
+    return 0;
+}
+
+// The child of '|>': everything that comes into in_fd goes to out_fd and to every file without passing through
+// user space. tee(2) duplicates what is in the pipe into a spare pipe that is spliced into a file, once for
+// each file, then the data is spliced out of the pipe into out_fd. Returns the exit code of the child.
+int run_fanout(int in_fd, int out_fd, int *files, int file_count){
+    int spare[2];
+    if (pipe2(spare, O_CLOEXEC) == -1) {
+        return 1;
+    }
+    grow_pipe(spare[1]);
+    // A tee into the empty spare pipe always takes everything it is asked for, so every file gets the same chunk
+    int limit = fcntl(spare[1], F_GETPIPE_SZ), in_size = fcntl(in_fd, F_GETPIPE_SZ);
+    if (in_size > 0 && in_size < limit) {
+        limit = in_size;
+    }
+    int status = 0, can_splice = 1; // Cleared when out_fd is something splice does not write to, like a terminal
+    while (1) {
+        ssize_t n = tee(in_fd, spare[1], limit, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) { // The end of the input
+            status = n < 0;
+            break;
+        }
+        for (int i = 0; i < file_count; i++) {
+            if (i > 0 && tee(in_fd, spare[1], n, 0) != n) {
+                return 1;
+            }
+            size_t left = splice_all(spare[0], files[i], n);
+            if (left > 0) { // A file that fails is left out from now on
+                dprintf(STDERR_FILENO, "|>: %s\n", strerror(errno));
+                copy_all(spare[0], -1, left); // Draining the rest of the chunk
+                files[i--] = files[--file_count];
+                status = 1;
+            }
+        }
+        size_t left = can_splice ? splice_all(in_fd, out_fd, n) : (size_t)n;
+        if (left > 0 && can_splice && errno != EINVAL) {
+            return 1;
+        }
+        if (left > 0) {
+            can_splice = 0;
+            if (copy_all(in_fd, out_fd, left) < 0) {
+                return 1;
+            }
+        }
+    }
+    return status;
+}
+
+// A method to start the child of a '|>' stage, it copies what comes into the read end of fan_pipe into out_fd
+// and the files. The child only keeps the fds it uses, so the pipes of the other stages get their end of file.
+pid_t start_fanout(Shell *shell, Command *command, const SpawnSpec *spec, int fan_pipe[2], int out_fd){
+    int *files = arena_alloc(&shell -> arena, command -> fanout_count * sizeof(int));
+    for (int i = 0; i < command -> fanout_count; i++) {
+        char *path = expand_word(shell, command -> fanout[i]);
+        files[i] = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (files[i] < 0) {
+            printf("Error opening the file %s\n", path);
+            while (i-- > 0) {
+                close(files[i]);
+            }
+            return -1;
+        }
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        spawn_child_setup(spec);
+        // Closing every fd but the ones we use, going up through them in order
+        int keep_count = command -> fanout_count + 2;
+        int *keep = arena_alloc(&shell -> arena, keep_count * sizeof(int));
+        keep[0] = fan_pipe[0];
+        keep[1] = out_fd;
+        memcpy(keep + 2, files, command -> fanout_count * sizeof(int));
+        for (int i = 1; i < keep_count; i++) {
+            for (int j = i; j > 0 && keep[j - 1] > keep[j]; j--) {
+                int fd = keep[j];
+                keep[j] = keep[j - 1];
+                keep[j - 1] = fd;
+            }
+        }
+        unsigned int next = STDERR_FILENO + 1; // The lowest fd that may still have to be closed
+        for (int i = 0; i < keep_count; i++) {
+            if ((unsigned int)keep[i] > next) {
+                close_range(next, keep[i] - 1, 0);
+            }
+            if ((unsigned int)keep[i] >= next) {
+                next = keep[i] + 1;
+            }
+        }
+        close_range(next, ~0U, 0);
+        _exit(run_fanout(fan_pipe[0], out_fd, files, command -> fanout_count));
+    }
+    for (int i = 0; i < command -> fanout_count; i++) {
+        close(files[i]);
+    }
+    return pid;
+}
+
+void run_parallel(Shell *shell, Pipeline *pipeline);
+void run_parallel_child(Shell *shell, Pipeline *pipeline, const struct timespec *start);
+void run_memo(Shell *shell, Pipeline *pipeline, const struct timespec *start);
+
+// A method to report the timing of a pipeline that ran without children of its own, only its wall time is known
+void pipeline_report(Shell *shell, Pipeline *pipeline, const struct timespec *start){
+    if (!pipeline -> timed && !shell -> stats && shell -> stats_fd < 0) {
+        return;
+    }
+    Job job;
+    memset(&job, 0, sizeof(job));
+    job.text = pipeline_text(pipeline);
+    job.timed = pipeline -> timed;
+    job.start = *start;
+    job.parse_ns = shell -> parse_ns;
+    job.status = shell -> last_status;
+    job_report(shell, &job);
+    free(job.text);
+}
+
+// A method to add a started child to the job of its pipeline, the first child creates the job
+Job *add_to_job(Shell *shell, Pipeline *pipeline, Job *job, pid_t pid, int own_group, int is_last,
+                const char *name, const struct timespec *start){
+    if (job == NULL) { // The first child leads the process group of the job
+        job = job_add(shell, pipeline, own_group ? pid : 0);
+        if (shell -> interactive && own_group && !pipeline -> background) {
+            tcsetpgrp(STDIN_FILENO, pid);
+        }
+    }
+    job_add_process(job, pid, name, start);
+    if (is_last) {
+        job -> last_pid = pid;
+    }
+    return job;
+}
+
+// A method to run a pipeline, every command runs in its own child connected to the next one with a pipe.
+// A builtin at either end of the pipeline runs inside the shell, a builtin in the middle or in a background
+// job gets a child.
+// The children form one job, with a process group of its own when the shell does job control or the job
+// runs in the background.
+void run_pipeline(Shell *shell, Pipeline *pipeline){
+    int count = pipeline -> count;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    shell -> glob_dirs = NULL; // The commands before this pipeline may have changed the directories
+    Command *first = &pipeline -> commands[0];
+    if (first -> argc > 1 && strcmp(first -> argv[0], "memo") == 0 && first -> argv[1][0] != '-') { // 'memo pipeline'
+        run_memo(shell, pipeline, &start);
+        return;
+    }
+    if (first -> group != NULL && shell -> async) { // 'parallel { ... }' of a server session
+        run_parallel_child(shell, pipeline, &start);
+        return;
+    }
+    if (first -> group != NULL) { // 'parallel { ... }'
+        run_parallel(shell, pipeline);
+        pipeline_report(shell, pipeline, &start);
+        return;
+    }
+    if (count == 1 && first -> redirect_count == 0 && first -> fanout_count == 0 && run_assignments(shell, first)) {
+        return;
+    }
+    Job *job = NULL; // Created when the first child starts
+    int own_group = shell -> interactive || pipeline -> background;
+    int tty_fd = shell -> interactive && !pipeline -> background ? STDIN_FILENO : -1;
+    int in_fd = STDIN_FILENO;
+    // A builtin at the start runs once the rest of the pipeline is started, so it never fills a pipe nobody reads
+    const Builtin *first_builtin = NULL;
+    char **first_argv = NULL;
+    int first_argc = 0;
+    int first_out = -1, first_err = -1;
+    for (int i = 0; i < count; i++) {
+        Command *command = &pipeline -> commands[i];
+        int argc;
+        char **argv = expand_command(shell, command, &argc);
+        SpawnSched *sched = NULL; // 'sched ... command' sets how the child of the stage is scheduled
+        int sched_words = 0;
+        if (argc > 0 && strcmp(argv[0], "sched") == 0) {
+            sched = arena_alloc(&shell -> arena, sizeof(SpawnSched));
+            sched_words = parse_sched(shell, argc, argv, sched);
+            if (sched_words > 0 && sched_words < argc) {
+                argv += sched_words;
+                argc -= sched_words;
+            } else { // A bad option skips the stage, and only options leave the builtin to tell what is missing
+                sched = NULL;
+                sched_words = sched_words < 0 ? -1 : 0;
+            }
+        }
+        const Builtin *builtin = find_builtin(argv[0]);
+        if (builtin != NULL && count > 1 && !(builtin -> flags & BUILTIN_PIPEABLE)) {
+            builtin = NULL; // The builtins that change the shell only run on their own
+        }
+        // A builtin of a background job or of a server session must not hold up the shell, the ones that change
+        // the shell still run in it
+        int builtin_child = builtin != NULL && ((i > 0 && i < count - 1) || ((pipeline -> background || shell -> async) &&
+                                                                            builtin -> flags & BUILTIN_PIPEABLE));
+        int pipe_fd[2] = {-1, -1}, fan_pipe[2] = {-1, -1}, files[3] = {-1, -1, -1};
+        int out_fd = STDOUT_FILENO;
+        if (i < count - 1) { // Every command but the last writes into a pipe
+            if (pipe2(pipe_fd, O_CLOEXEC) == -1) { // The children only get the ends they dup2
+                printf("Error opening the pipe\n");
+                exit(1);
+            }
+            out_fd = pipe_fd[1];
+        }
+        // The command reads from the previous pipe and writes into the next one, unless it redirects them to files
+        int opened = sched_words >= 0 && open_redirects(shell, command, files) == 0;
+        int stage_in = files[0] >= 0 ? files[0] : in_fd;
+        int stage_out = files[1] >= 0 ? files[1] : out_fd;
+        int stage_err = files[2] >= 0 ? files[2] : STDERR_FILENO;
+        struct timespec stage_start;
+        if (opened && command -> fanout_count > 0) { // With '|>' the output goes through a child that copies it
+            SpawnSpec fan_spec = {NULL, NULL, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO,
+                                  own_group ? (job != NULL ? job -> pgid : 0) : -1, tty_fd, NULL};
+            if (pipe2(fan_pipe, O_CLOEXEC) == -1) {
+                printf("Error opening the pipe\n");
+                exit(1);
+            }
+            grow_pipe(fan_pipe[1]);
+            if (stage_out == pipe_fd[1]) {
+                grow_pipe(stage_out);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &stage_start);
+            pid_t pid = start_fanout(shell, command, &fan_spec, fan_pipe, stage_out);
+            if (pid < 0) {
+                opened = 0;
+            } else {
+                if (fan_spec.pgid >= 0) {
+                    setpgid(pid, fan_spec.pgid == 0 ? pid : fan_spec.pgid);
+                }
+                job = add_to_job(shell, pipeline, job, pid, own_group, 0, "|>", &stage_start);
+                stage_out = fan_pipe[1];
+            }
+        }
+        SpawnSpec spec = {argv, NULL, stage_in, stage_out, stage_err, own_group ? (job != NULL ? job -> pgid : 0) : -1, tty_fd,
+                          sched};
+        if (builtin == NULL || builtin -> flags & BUILTIN_PIPEABLE) {
+            shell -> arg_count += argc;
+        }
+        if (!opened) { // Skipping a command whose files could not be opened
+            shell -> last_status = 1;
+        } else if (builtin != NULL && !builtin_child && i == 0 && count > 1) {
+            first_builtin = builtin;
+            first_argv = argv;
+            first_argc = argc;
+            first_out = stage_out;
+            first_err = stage_err;
+            shell -> command_count++;
+        } else if (builtin != NULL && !builtin_child) {
+            shell -> last_status = run_builtin_stage(shell, builtin, argc, argv, stage_out, stage_err);
+            if (builtin -> flags & BUILTIN_PIPEABLE) {
+                shell -> command_count++;
+            }
+            if (shell -> waiting != NULL) { // 'fg' or 'wait' of a session, the line goes on once the job is done
+                return;
+            }
+        } else if (builtin != NULL) { // A builtin in its own process runs next to the others
+            fflush(stdout);
+            clock_gettime(CLOCK_MONOTONIC, &stage_start);
+            pid_t pid = fork();
+            if (pid == 0) {
+                spawn_child_setup(&spec);
+                int unused[] = {in_fd, pipe_fd[0], fan_pipe[0]}; // Without an exec the close-on-exec fds stay open
+                for (size_t j = 0; j < sizeof(unused) / sizeof(unused[0]); j++) {
+                    if (unused[j] > STDERR_FILENO) { // The builtins do not read, no writer may wait on our copy
+                        close(unused[j]);
+                    }
+                }
+                if (stage_err != STDERR_FILENO) {
+                    dup2(stage_err, STDERR_FILENO);
+                }
+                _exit(builtin -> run(shell, argc, argv, stage_out));
+            }
+            shell -> command_count++;
+            if (pid < 0) {
+                printf("ERR\n");
+            } else {
+                if (spec.pgid >= 0) { // Also done here, so the next child can join the group right away
+                    setpgid(pid, spec.pgid == 0 ? pid : spec.pgid);
+                }
+                job = add_to_job(shell, pipeline, job, pid, own_group, i == count - 1, argv[0], &stage_start);
+            }
+        } else {
+            fflush(stdout); // So our buffered output comes before the output of the child
+            clock_gettime(CLOCK_MONOTONIC, &stage_start); // The spawn time includes looking up the path
+            int cached;
+            spec.path = resolve_command(shell, argv[0], &cached);
+            pid_t pid = spec.path != NULL ? spawn_process(shell -> spawn, &spec) : -1;
+            if (pid < 0 && cached && errno == ENOENT) { // The cached path is gone, searching PATH again
+                var_unset(shell -> path_cache, argv[0]);
+                spec.path = resolve_command(shell, argv[0], &cached);
+                pid = spec.path != NULL ? spawn_process(shell -> spawn, &spec) : -1;
+            }
+            shell -> command_count++;
+            if (pid < 0) { // The command could not be executed
+                printf("ERR\n");
+                shell -> last_status = 127;
+            } else {
+                job = add_to_job(shell, pipeline, job, pid, own_group, i == count - 1, argv[0], &stage_start);
+            }
+        }
+        // Closing our copies of the fds the children use, the builtin at the start keeps its fds until it runs
+        if (in_fd != STDIN_FILENO) {
+            close(in_fd);
+        }
+        if (fan_pipe[0] >= 0) {
+            close(fan_pipe[0]);
+        }
+        int stage_fds[] = {out_fd, files[0], files[1], files[2], fan_pipe[1]};
+        for (size_t j = 0; j < sizeof(stage_fds) / sizeof(stage_fds[0]); j++) {
+            if (stage_fds[j] > STDERR_FILENO && stage_fds[j] != first_out && stage_fds[j] != first_err) {
+                close(stage_fds[j]);
+            }
+        }
+        in_fd = pipe_fd[0];
+    }
+    if (first_builtin != NULL) {
+        run_builtin_stage(shell, first_builtin, first_argc, first_argv, first_out, first_err);
+        close(first_out);
+        if (first_err != STDERR_FILENO) {
+            close(first_err);
+        }
+    }
+    if (job == NULL) { // Nothing ran in a child
+        pipeline_report(shell, pipeline, &start);
+        return;
+    }
+    job -> timed = pipeline -> timed;
+    job -> start = start;
+    job -> parse_ns = shell -> parse_ns;
+    if (pipeline -> background) { // Background job, continue without waiting for the children
+        shell -> current_job = job -> id;
+        shell -> last_status = 0;
+        if (shell -> interactive) {
+            printf("[%d] %d\n", job -> id, job -> pgid);
+        }
+        return;
+    }
+    if (shell -> async) { // The server goes on with the line of the session once the job is done
+        shell -> waiting = job;
+        return;
+    }
+    job_foreground(shell, job); // Foreground job, waiting for all the children to complete
+}
+
+// A task of 'parallel', its output and its errors are held back until every task before it has printed its own
+typedef struct parallel_task{
+    Pipeline *pipeline;
+    pid_t pid; // -1 when it did not start
+    int fds[2]; // The read ends of the output and the errors of the task, -1 once they are closed
+    int done;
+    int status; // The exit code of the task
+    StrBuf output[2]; // The output and the errors read while an earlier task is still printing
+}ParallelTask;
+
+// A method to start a task of 'parallel' with its output and its errors going into pipes, it reads in_fd.
+// A single program is spawned directly, anything else runs in a copy of the shell.
+void parallel_start(Shell *shell, ParallelTask *task, int in_fd){
+    Pipeline *pipeline = task -> pipeline;
+    Command *command = &pipeline -> commands[0];
+    int pipe_fd[2], err_pipe[2];
+    if (pipe2(pipe_fd, O_CLOEXEC) == -1) {
+        strbuf_printf(&task -> output[0], "Error opening the pipe\n");
+        task -> done = 1;
+        task -> status = 1;
+        return;
+    }
+    if (pipe2(err_pipe, O_CLOEXEC) == -1) {
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        strbuf_printf(&task -> output[0], "Error opening the pipe\n");
+        task -> done = 1;
+        task -> status = 1;
+        return;
+    }
+    const char *path = NULL;
+    char **argv = NULL;
+    if (pipeline -> count == 1 && command -> redirect_count == 0 && command -> fanout_count == 0 &&
+        command -> group == NULL && !pipeline -> background) {
+        int all_assignments = 1;
+        for (int i = 0; i < command -> argc && all_assignments; i++) {
+            all_assignments = assignment_name_length(command -> argv[i]) > 0;
+        }
+        if (!all_assignments) {
+            int argc;
+            argv = expand_command(shell, command, &argc);
+            int cached;
+            path = find_builtin(argv[0]) == NULL ? resolve_command(shell, argv[0], &cached) : NULL;
+        }
+    }
+    fflush(stdout); // So a copy of the shell does not print our buffered output again
+    pid_t pid;
+    if (path != NULL) {
+        SpawnSpec spec = {argv, path, in_fd, pipe_fd[1], err_pipe[1], -1, -1, NULL};
+        pid = spawn_process(shell -> spawn, &spec);
+    } else {
+        pid = fork();
+        if (pid == 0) { // The copy of the shell runs the task like a script would
+            dup2(pipe_fd[1], STDOUT_FILENO);
+            dup2(err_pipe[1], STDERR_FILENO);
+            if (in_fd != STDIN_FILENO) {
+                dup2(in_fd, STDIN_FILENO);
+            }
+            shell -> interactive = 0;
+            run_pipeline(shell, pipeline);
+            fflush(stdout);
+            _exit(shell -> last_status);
+        }
+    }
+    close(pipe_fd[1]);
+    close(err_pipe[1]);
+    if (pid < 0) { // The command could not be executed
+        close(pipe_fd[0]);
+        close(err_pipe[0]);
+        strbuf_printf(&task -> output[0], "ERR\n");
+        task -> done = 1;
+        task -> status = 127;
+        return;
+    }
+    task -> pid = pid;
+    task -> fds[0] = pipe_fd[0];
+    task -> fds[1] = err_pipe[0];
+}
+
+// Running the commands of a group at the same time, 'parallel [-j N] { cmd1; cmd2; ... }'. At most N tasks
+// run at once, N is the number of online CPUs by default. The output and the errors of every task are printed
+// in the order of the tasks, $? is the number of tasks that failed and PARALLEL_STATUS holds every exit code.
+void run_parallel(Shell *shell, Pipeline *pipeline){
+    Command *command = &pipeline -> commands[0];
+    int argc;
+    char **argv = expand_command(shell, command, &argc);
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            workers = atol(argv[++i]);
+        } else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2] != '\0') {
+            workers = atol(argv[i] + 2);
+        } else {
+            dprintf(STDERR_FILENO, "parallel: usage: parallel [-j N] { command; ... }\n");
+            shell -> last_status = 2;
+            return;
+        }
+    }
+    CommandLine *group = command -> group;
+    int count = group -> count;
+    if (workers < 1) {
+        workers = 1;
+    }
+    if (workers > count) {
+        workers = count > 0 ? count : 1;
+    }
+    int files[3];
+    if (open_redirects(shell, command, files) < 0) {
+        shell -> last_status = 1;
+        return;
+    }
+    int in = files[0] >= 0 ? files[0] : STDIN_FILENO;
+    int out = files[1] >= 0 ? files[1] : STDOUT_FILENO;
+    int err = files[2] >= 0 ? files[2] : STDERR_FILENO;
+    ParallelTask *tasks = arena_alloc(&shell -> arena, count * sizeof(ParallelTask));
+    for (int i = 0; i < count; i++) {
+        tasks[i].pipeline = &group -> pipelines[i];
+        tasks[i].pid = tasks[i].fds[0] = tasks[i].fds[1] = -1;
+        tasks[i].done = tasks[i].status = 0;
+        strbuf_init(&tasks[i].output[0], &shell -> arena, 0);
+        strbuf_init(&tasks[i].output[1], &shell -> arena, 0);
+    }
+    int outs[2] = {out, err};
+    int *active = arena_alloc(&shell -> arena, workers * sizeof(int)); // The tasks that still have output to read
+    struct pollfd *fds = arena_alloc(&shell -> arena, 2 * workers * sizeof(struct pollfd)); // Two per task
+    char *chunk = arena_alloc(&shell -> arena, COPY_CHUNK);
+    int started = 0, printed = 0;
+    nfds_t active_count = 0; // Never more than workers, the size of active and fds
+    while (printed < count) {
+        while (active_count < (nfds_t)workers && started < count) {
+            ParallelTask *task = &tasks[started];
+            parallel_start(shell, task, in);
+            shell -> command_count++;
+            if (!task -> done) {
+                active[active_count++] = started;
+            }
+            started++;
+        }
+        // The first task that is not printed yet writes its output as it comes, the ones after it wait
+        while (printed < started) {
+            ParallelTask *task = &tasks[printed];
+            for (int s = 0; s < 2; s++) {
+                if (task -> output[s].length > 0) {
+                    write_all(outs[s], task -> output[s].data, task -> output[s].length);
+                    task -> output[s].length = 0;
+                }
+            }
+            if (!task -> done) {
+                break;
+            }
+            printed++;
+        }
+        if (active_count == 0) {
+            continue;
+        }
+        for (nfds_t i = 0; i < 2 * active_count; i++) { // A closed stream has fd -1, poll skips it
+            fds[i].fd = tasks[active[i / 2]].fds[i % 2];
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if (poll(fds, 2 * active_count, -1) < 0) {
+            continue;
+        }
+        for (nfds_t i = active_count; i-- > 0;) { // Going backwards, so a finished task can be swapped out
+            ParallelTask *task = &tasks[active[i]];
+            for (int s = 0; s < 2; s++) {
+                if (fds[2 * i + s].revents == 0) {
+                    continue;
+                }
+                ssize_t n = read(task -> fds[s], chunk, COPY_CHUNK);
+                if (n > 0) {
+                    if (active[i] == printed) {
+                        write_all(outs[s], chunk, n);
+                    } else {
+                        strbuf_append(&task -> output[s], chunk, n);
+                    }
+                } else if (n == 0 || errno != EINTR) { // The end of the stream
+                    close(task -> fds[s]);
+                    task -> fds[s] = -1;
+                }
+            }
+            if (task -> fds[0] >= 0 || task -> fds[1] >= 0) {
+                continue;
+            }
+            // Both streams ended, the task is done once its process exits
+            int status;
+            if (waitpid(task -> pid, &status, 0) == task -> pid) {
+                task -> status = exit_code(status);
+            }
+            task -> done = 1;
+            active[i] = active[--active_count];
+        }
+    }
+    close_redirects(files);
+    // Collecting the exit codes
+    StrBuf statuses;
+    strbuf_init(&statuses, &shell -> arena, count * 4);
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        strbuf_printf(&statuses, i == 0 ? "%d" : " %d", tasks[i].status);
+        failed += tasks[i].status != 0;
+    }
+    var_set(&shell -> vars, "PARALLEL_STATUS", statuses.data);
+    shell -> last_status = failed > 255 ? 255 : failed;
+}
+
+// A method to run 'parallel' for a session of a server in a copy of the shell, so the server goes on with the
+// other sessions while it runs. The line of the session waits for it like for any job, and the copy hands
+// PARALLEL_STATUS back in a memfd.
+void run_parallel_child(Shell *shell, Pipeline *pipeline, const struct timespec *start){
+    int status_fd = memfd_create("parallel", MFD_CLOEXEC);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) { // The copy keeps none of the fds of the server, the clients of the other sessions see theirs close
+        if (status_fd > STDERR_FILENO + 1) {
+            close_range(STDERR_FILENO + 1, status_fd - 1, 0);
+        }
+        close_range(status_fd > STDERR_FILENO ? status_fd + 1 : STDERR_FILENO + 1, ~0U, 0);
+        shell -> signal_fd = -1;
+        shell -> on_other_child = NULL;
+        shell -> async = 0;
+        run_parallel(shell, pipeline);
+        const char *statuses = var_get(&shell -> vars, "PARALLEL_STATUS");
+        if (statuses != NULL && status_fd >= 0) {
+            write_all(status_fd, statuses, strlen(statuses));
+        }
+        fflush(stdout);
+        _exit(shell -> last_status);
+    }
+    shell -> command_count++;
+    if (pid < 0) {
+        printf("ERR\n");
+        if (status_fd >= 0) {
+            close(status_fd);
+        }
+        shell -> last_status = 1;
+        return;
+    }
+    Job *job = add_to_job(shell, pipeline, NULL, pid, 0, 1, "parallel", start);
+    job -> status_fd = status_fd;
+    job -> timed = pipeline -> timed;
+    job -> start = *start;
+    job -> parse_ns = shell -> parse_ns;
+    shell -> waiting = job;
+}
+
+// A method to hash the key of a 'memo' entry (FNV-1a), two seeds give the 128 bits of the name of the entry
+uint64_t memo_hash(const char *data, size_t length, uint64_t hash){
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// A method to add the identity of a file to the key of a 'memo' entry, so the entry is stale once the file
+// changes. Words that are not files add nothing.
+void memo_key_file(StrBuf *key, const char *path){
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        strbuf_printf(key, "file %lu %lu %lld %lld.%09ld\n", (unsigned long)st.st_dev, (unsigned long)st.st_ino,
+                      (long long)st.st_size, (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    }
+}
+
+// A method to build the key of a pipeline for 'memo': the current directory, the expanded words, '<' files and
+// here-documents of every stage, the identity of every command and of every word that names a file, and the environment the
+// commands get. Every string is prefixed with its length so no two pipelines share a key. Returns -1 if the
+// pipeline can not be cached: it writes to files, has a '|>' or a 'parallel', or runs a builtin that changes
+// the shell.
+int memo_key(Shell *shell, Pipeline *pipeline, StrBuf *key){
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        return -1;
+    }
+    strbuf_printf(key, "cwd %zu %s\n", strlen(cwd), cwd);
+    free(cwd);
+    for (int i = 0; i < pipeline -> count; i++) {
+        Command *command = &pipeline -> commands[i];
+        if (command -> group != NULL || command -> fanout_count > 0) {
+            return -1;
+        }
+        for (int j = 0; j < command -> redirect_count; j++) {
+            if (command -> redirects[j].flags != O_RDONLY) {
+                return -1;
+            }
+            if (command -> redirects[j].kind != REDIRECT_FILE) { // The input itself is part of the key
+                size_t length;
+                char *text = here_text(shell, &command -> redirects[j], &length);
+                strbuf_printf(key, "<< %zu ", length);
+                strbuf_append(key, text, length);
+                continue;
+            }
+            char *path = expand_word(shell, command -> redirects[j].target);
+            strbuf_printf(key, "< %zu %s\n", strlen(path), path);
+            memo_key_file(key, path);
+        }
+        int argc;
+        char **argv = expand_command(shell, command, &argc);
+        if (argc == 0) {
+            return -1;
+        }
+        const Builtin *builtin = find_builtin(argv[0]);
+        if (builtin != NULL && !(builtin -> flags & BUILTIN_PIPEABLE)) {
+            return -1;
+        }
+        if (builtin != NULL) {
+            strbuf_printf(key, "builtin %s\n", argv[0]);
+        } else {
+            int cached;
+            const char *path = resolve_command(shell, argv[0], &cached);
+            if (path == NULL) {
+                return -1;
+            }
+            strbuf_printf(key, "command %zu %s\n", strlen(path), path);
+            memo_key_file(key, path);
+        }
+        for (int j = 1; j < argc; j++) {
+            strbuf_printf(key, "arg %zu %s\n", strlen(argv[j]), argv[j]);
+            memo_key_file(key, argv[j]);
+        }
+    }
+    for (char **env = environ; *env != NULL; env++) {
+        strbuf_printf(key, "env %zu %s\n", strlen(*env), *env);
+    }
+    return 0;
+}
+
+// A method to copy the first length bytes of an entry of the cache to out_fd, with sendfile so they are not
+// copied through the shell
+void memo_replay(int fd, off_t length, int out_fd){
+    off_t offset = 0;
+    while (offset < length) {
+        ssize_t n = sendfile(out_fd, fd, &offset, length - offset);
+        if (n > 0) {
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) { // stdout does not take sendfile
+            break;
+        }
+        return;
+    }
+    char buffer[COPY_CHUNK];
+    while (offset < length) {
+        size_t chunk = length - offset < (off_t)sizeof(buffer) ? (size_t)(length - offset) : sizeof(buffer);
+        ssize_t n = pread(fd, buffer, chunk, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0 || write_all(out_fd, buffer, n) < 0) {
+            return;
+        }
+        offset += n;
+    }
+}
+
+// A method to check that an entry of the cache was stored for this key, a different key with the same hash
+// is a miss. Gives the length of the output and the exit code, returns 0 for a match.
+int memo_check(Shell *shell, int fd, StrBuf *key, off_t *length, int *status){
+    struct stat st;
+    MemoTrailer trailer;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(trailer) ||
+        pread(fd, &trailer, sizeof(trailer), st.st_size - sizeof(trailer)) != sizeof(trailer) ||
+        trailer.magic != MEMO_MAGIC || trailer.key_length != key -> length ||
+        (uint64_t)st.st_size < sizeof(trailer) + trailer.key_length) {
+        return -1;
+    }
+    *length = st.st_size - sizeof(trailer) - trailer.key_length;
+    char *stored = arena_alloc(&shell -> arena, key -> length);
+    if (pread(fd, stored, key -> length, *length) != (ssize_t)key -> length ||
+        memcmp(stored, key -> data, key -> length) != 0) {
+        return -1;
+    }
+    *status = trailer.status;
+    return 0;
+}
+
+// A method to finish a miss of 'memo' once its pipeline is over, the output is replayed and the entry is kept
+// if the pipeline completed and was not killed
+void memo_finish(Shell *shell, MemoRun *run, int status, int complete){
+    MemoCache *memo = &shell -> memo;
+    fflush(stdout); // A builtin of the pipeline may still have its output buffered
+    off_t length = lseek(run -> out, 0, SEEK_END); // The children share the offset of the file, it is at the end
+    memo_replay(run -> out, length, run -> stdout_fd);
+    MemoTrailer trailer = {run -> key_length, status, 0, MEMO_MAGIC};
+    if (complete && length >= 0 && status < 128 && write_all(run -> out, run -> key, run -> key_length) == 0 &&
+        write_all(run -> out, (const char *)&trailer, sizeof(trailer)) == 0 && rename(run -> temp, run -> path) == 0) {
+        memo -> stores++;
+        memo -> size += length + run -> key_length + sizeof(trailer);
+        memo_evict(shell, 0);
+    } else {
+        unlink(run -> temp);
+    }
+    close(run -> out);
+    close(run -> stdout_fd);
+    free(run -> temp);
+    free(run -> path);
+    free(run -> key);
+    free(run);
+}
+
+// A method to run a pipeline that starts with 'memo'. On a hit its output and exit code are replayed from the
+// cache without starting anything. On a miss it runs with its stdout going into a new entry, which is replayed
+// once the pipeline is over, so nothing shows up until then. A job stopped with ctrl z keeps the entry until
+// it is done, and the entry is kept if the pipeline was not killed. A pipeline that can not be cached just runs.
+void run_memo(Shell *shell, Pipeline *pipeline, const struct timespec *start){
+    MemoCache *memo = &shell -> memo;
+    Command *first = &pipeline -> commands[0];
+    first -> argv++; // Dropping the 'memo'
+    first -> argc--;
+    StrBuf key;
+    strbuf_init(&key, &shell -> arena, 1024);
+    if (pipeline -> background || shell -> async || memo_open(shell) != 0 || memo_key(shell, pipeline, &key) != 0) {
+        memo -> bypassed++;
+        run_pipeline(shell, pipeline);
+        return;
+    }
+    StrBuf path;
+    strbuf_init(&path, &shell -> arena, strlen(memo -> dir) + 64);
+    strbuf_printf(&path, "%s/%016llx%016llx", memo -> dir,
+                  (unsigned long long)memo_hash(key.data, key.length, 14695981039346656037ULL),
+                  (unsigned long long)memo_hash(key.data, key.length, 0x84222325cbf29ce4ULL));
+    int fd = open(path.data, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        off_t length;
+        int status;
+        if (memo_check(shell, fd, &key, &length, &status) == 0) {
+            futimens(fd, NULL); // The mtime is when the entry was last used
+            fflush(stdout);
+            memo_replay(fd, length, STDOUT_FILENO);
+            close(fd);
+            memo -> hits++;
+            memo -> replayed += length;
+            shell -> last_status = status;
+            pipeline_report(shell, pipeline, start);
+            return;
+        }
+        close(fd);
+    }
+    StrBuf temp; // Named with a '.' so no scan counts it before it is complete
+    strbuf_init(&temp, &shell -> arena, strlen(memo -> dir) + 32);
+    strbuf_printf(&temp, "%s/.new-XXXXXX", memo -> dir);
+    int out = mkostemp(temp.data, O_CLOEXEC);
+    if (out < 0) {
+        memo -> bypassed++;
+        run_pipeline(shell, pipeline);
+        return;
+    }
+    memo -> misses++;
+    fflush(stdout);
+    MemoRun *run = malloc(sizeof(MemoRun));
+    if (run == NULL || (run -> temp = strdup(temp.data)) == NULL || (run -> path = strdup(path.data)) == NULL ||
+        (run -> key = malloc(key.length)) == NULL) {
+        printf("ERR\n");
+        exit(1);
+    }
+    memcpy(run -> key, key.data, key.length);
+    run -> key_length = key.length;
+    run -> out = out;
+    run -> stdout_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(out, STDOUT_FILENO);
+    shell -> memo_run = run; // The job of the pipeline takes it and finishes it when it leaves the table
+    run_pipeline(shell, pipeline);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    fflush(stdout); // The builtins write to their fd, so what is left is the shell's own, like the note of a stop
+    if (shell -> memo_run != NULL) { // Only builtins ran, so there was no job
+        shell -> memo_run = NULL;
+        memo_finish(shell, run, shell -> last_status, 1);
+    }
+}
+
+// A method to reap the children when the signalfd wakes up the line reader
+void reap_callback(void *ctx){
+    reap_children(ctx);
+}
+
+// A method to release the memory of the shell
+void free_shell(Shell *shell){
+    var_free(&shell -> vars);
+    var_free(&shell -> own_path_cache);
+    free_jobs(shell);
+    history_close(&shell -> history);
+    free(shell -> sched_cpus);
+    free(shell -> memo.dir);
+    arena_free(&shell -> arena);
+}
+
+// A method to expand the '!!', '!n', '!-n' and '!prefix' of a line to lines of the history. A '!' before a space,
+// '=' or '(' and everything in single quotes stay as they are. Returns the line, a new one in the arena when
+// something was expanded, or NULL if a line is not in the history.
+char *history_expand(Shell *shell, char *line){
+    if (strchr(line, '!') == NULL) {
+        return line;
+    }
+    History *history = &shell -> history;
+    StrBuf out;
+    strbuf_init(&out, &shell -> arena, strlen(line) + 64);
+    const char *run = line; // The chars since the last expansion are appended at once
+    char quote = 0;
+    for (const char *p = line; *p != '\0'; p++) {
+        if (*p == '\\' && quote != '\'' && p[1] != '\0') {
+            p++;
+            continue;
+        }
+        if ((*p == '\'' || *p == '"') && (quote == 0 || quote == *p)) {
+            quote = quote == 0 ? *p : 0;
+            continue;
+        }
+        if (*p != '!' || quote == '\'') {
+            continue;
+        }
+        const char *q = p + 1;
+        long id;
+        history_index(history);
+        if (*q == '!') { // The last line
+            id = (long)history -> count - 1;
+            q++;
+        } else if (isdigit((unsigned char)*q) || (*q == '-' && isdigit((unsigned char)q[1]))) { // Line n, or n back
+            char *end;
+            long n = strtol(q, &end, 10);
+            id = n > 0 ? n - 1 : (long)history -> count + n;
+            q = end;
+        } else { // The newest line that starts with the word
+            size_t length = strcspn(q, " \t=();|&<>\"'");
+            if (length == 0) {
+                continue;
+            }
+            id = history_latest(history, q, length);
+            q += length;
+        }
+        if (id < 0 || id >= (long)history -> count) {
+            printf("%.*s: event not found\n", (int)(q - p), p);
+            return NULL;
+        }
+        strbuf_append(&out, run, p - run);
+        strbuf_append(&out, history -> lines[id].text, history -> lines[id].length);
+        run = q;
+        p = q - 1;
+    }
+    if (run == line) {
+        return line;
+    }
+    strbuf_append(&out, run, strlen(run));
+    printf("%s\n", out.data); // Showing what runs
+    return out.data;
+}
+
+// A method to parse a line, the time it takes is part of the timing of its pipelines
+CommandLine *shell_parse(Shell *shell, const char *line){
+    struct timespec parse_start, parse_end;
+    clock_gettime(CLOCK_MONOTONIC, &parse_start);
+    CommandLine *cmd_line = parse_line(&shell -> arena, line);
+    clock_gettime(CLOCK_MONOTONIC, &parse_end);
+    shell -> parse_ns = elapsed_ns(&parse_start, &parse_end);
+    return cmd_line;
+}
+
+#define SERVER_MAX_EVENTS 64 // How many epoll events the server takes at once
+
+// A client of the server, its lines run in a shell of its own
+typedef struct session{
+    int fd; // The connection
+    int files[3]; // The stdin, stdout and stderr the client sent with its line, -1 when no line runs
+    Shell shell; // The variables and the jobs of the session
+    CommandLine *line; // The line that runs, NULL when the session waits for the next one
+    int next; // The next pipeline of the line
+    int more; // Set while the line waits for the client to send the rest of the bodies of its here-documents
+}Session;
+
+// The state of 'shell --server', the sessions run in one process so they share the path cache
+typedef struct server{
+    Shell *base; // The shell that started the server, its path cache is the shared one
+    int listen_fd;
+    int epoll_fd;
+    Session **sessions; // By the fd of their connection
+    int capacity;
+    char **environ; // The environment of the server, the exported variables of a session go on top of it
+    int std_fds[3]; // Copies of the stdin, stdout and stderr of the server, they are back while no line runs
+}Server;
+
+// A method to build the environment of the children of a session: the environment of the server with the
+// exported variables of the session on top of it. It lives in the arena of the session.
+char **session_environ(Shell *shell, char **base){
+    VarTable *vars = &shell -> vars;
+    size_t exported = 0;
+    for (size_t i = 0; i < vars -> capacity; i++) {
+        VarEntry *slot = &vars -> slots[i];
+        exported += slot -> name != NULL && slot -> name != VAR_TOMBSTONE && slot -> exported;
+    }
+    if (exported == 0) {
+        return base;
+    }
+    size_t count = 0;
+    while (base[count] != NULL) {
+        count++;
+    }
+    char **env = arena_alloc(&shell -> arena, (count + exported + 1) * sizeof(char *)), **p = env;
+    for (size_t i = 0; i < count; i++) {
+        size_t length = strchrnul(base[i], '=') - base[i];
+        VarEntry *slot = var_find_slot(vars -> slots, vars -> capacity, base[i], length, var_hash(base[i], length));
+        if (slot -> name == NULL || slot -> name == VAR_TOMBSTONE || !slot -> exported) { // Not hidden by the session
+            *p++ = base[i];
+        }
+    }
+    for (size_t i = 0; i < vars -> capacity; i++) {
+        VarEntry *slot = &vars -> slots[i];
+        if (slot -> name != NULL && slot -> name != VAR_TOMBSTONE && slot -> exported) {
+            size_t name_len = slot -> value - slot -> name - 1, value_len = strlen(slot -> value);
+            char *entry = arena_alloc(&shell -> arena, name_len + value_len + 2);
+            memcpy(entry, slot -> name, name_len);
+            entry[name_len] = '=';
+            memcpy(entry + name_len + 1, slot -> value, value_len + 1);
+            *p++ = entry;
+        }
+    }
+    *p = NULL;
+    return env;
+}
+
+// A method to give a child that no job of the server itself knows to the session it belongs to
+void server_child(void *ctx, pid_t pid, int status, const struct rusage *usage){
+    Server *server = ctx;
+    for (int i = 0; i < server -> capacity; i++) {
+        if (server -> sessions[i] != NULL && job_update(&server -> sessions[i] -> shell, pid, status, usage)) {
+            return;
+        }
+    }
+}
+
+// A method to switch the stdin, stdout and stderr of the process to the ones of a session, or back to the
+// ones of the server when the session is NULL
+void session_switch(Server *server, Session *session){
+    fflush(stdout);
+    for (int i = 0; i < 3; i++) {
+        dup2(session != NULL ? session -> files[i] : server -> std_fds[i], i);
+    }
+    if (session == NULL) {
+        environ = server -> environ;
+    }
+}
+
+// A method to listen to the next line of a session again, or only to a hang up while a line runs
+void session_listen(Server *server, Session *session, int events){
+    struct epoll_event event = {events, {.fd = session -> fd}};
+    epoll_ctl(server -> epoll_fd, EPOLL_CTL_MOD, session -> fd, &event);
+}
+
+// A method to end the line of a session, the client gets its exit code
+void session_done(Server *server, Session *session){
+    for (int i = 0; i < 3; i++) {
+        close(session -> files[i]);
+        session -> files[i] = -1;
+    }
+    session -> line = NULL;
+    arena_reset(&session -> shell.arena);
+    char reply[16];
+    int length = snprintf(reply, sizeof(reply), "%d", session -> shell.last_status);
+    send(session -> fd, reply, length, MSG_NOSIGNAL);
+    session_listen(server, session, EPOLLIN);
+}
+
+// A method to run the line of a session until it has to wait for a foreground job, or to its end
+void session_run(Server *server, Session *session){
+    Shell *shell = &session -> shell;
+    session_switch(server, session);
+    if (shell -> waiting != NULL && shell -> wait_again) { // The job 'wait' waited for is done, it looks again
+        session -> next--;
+    } else if (shell -> waiting != NULL) { // The job the line waited for is done
+        job_settle(shell, shell -> waiting);
+    }
+    shell -> waiting = NULL;
+    shell -> wait_again = 0;
+    while (shell -> waiting == NULL && session -> next < session -> line -> count) {
+        environ = session_environ(shell, server -> environ); // An 'export' of the line counts from the next pipeline
+        run_pipeline(shell, &session -> line -> pipelines[session -> next++]);
+    }
+    if (shell -> waiting == NULL) {
+        report_jobs(shell, 0);
+    }
+    session_switch(server, NULL);
+    if (shell -> waiting == NULL) {
+        session_done(server, session);
+    }
+}
+
+// A method to read the bodies of the here-documents of the line of a session and run the line once they are all
+// there. A client that sends one line at a time gets a '>' instead of an exit code while lines are missing.
+void session_bodies(Server *server, Session *session, LineReader *bodies){
+    if (read_heredocs(&session -> shell.arena, session -> line, bodies, 0) < 0) {
+        session -> more = 1;
+        send(session -> fd, ">", 1, MSG_NOSIGNAL);
+        session_listen(server, session, EPOLLIN);
+        return;
+    }
+    session -> more = 0;
+    session_run(server, session);
+}
+
+// A method to read the next line of a session, with the fds of the client, and start it. Returns -1 once the
+// client is gone or it broke the protocol
+int session_read(Server *server, Session *session){
+    Shell *shell = &session -> shell;
+    ssize_t length = recv(session -> fd, NULL, 0, MSG_PEEK | MSG_TRUNC); // The size of the line
+    if (length < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    }
+    if (length <= 0) {
+        return -1;
+    }
+    char *line = arena_alloc(&shell -> arena, length + 1);
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = {line, length};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(session -> fd, &msg, MSG_CMSG_CLOEXEC) != length) {
+        return -1;
+    }
+    line[length] = '\0';
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg -> cmsg_level != SOL_SOCKET || cmsg -> cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    int fd_count = (cmsg -> cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int fds[3];
+    memcpy(fds, CMSG_DATA(cmsg), (fd_count < 3 ? fd_count : 3) * sizeof(int));
+    if (fd_count != 3 || (msg.msg_flags & MSG_CTRUNC)) { // Every line comes with exactly 3 fds
+        for (int i = 0; i < fd_count && i < 3; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    session_listen(server, session, 0);
+    if (session -> more) { // More lines of the bodies, the line keeps the fds it came with
+        for (int i = 0; i < 3; i++) {
+            close(fds[i]);
+        }
+        LineReader bodies = {-1, line, 0, 0, 0, length, 1, -1, NULL, NULL}; // The input is all there
+        session_bodies(server, session, &bodies);
+        return 0;
+    }
+    memcpy(session -> files, fds, sizeof(fds));
+    char *rest = strchr(line, '\n'); // The lines after the first one are the bodies of its here-documents
+    if (rest != NULL) {
+        *rest++ = '\0';
+    }
+    session -> line = shell_parse(shell, line);
+    session -> next = 0;
+    if (session -> line == NULL) {
+        session_switch(server, session);
+        printf("Syntax error\n");
+        session_switch(server, NULL);
+        session_done(server, session);
+        return 0;
+    }
+    char *start = rest != NULL ? rest : line + length;
+    LineReader bodies = {-1, start, 0, 0, 0, line + length - start, 1, -1, NULL, NULL};
+    session_bodies(server, session, &bodies);
+    return 0;
+}
+
+// A method to start a session for a new client
+void session_add(Server *server, int fd){
+    if (fd >= server -> capacity) {
+        int capacity = fd + 64;
+        server -> sessions = realloc(server -> sessions, capacity * sizeof(Session *));
+        if (server -> sessions == NULL) {
+            printf("ERR\n");
+            exit(1);
+        }
+        memset(server -> sessions + server -> capacity, 0, (capacity - server -> capacity) * sizeof(Session *));
+        server -> capacity = capacity;
+    }
+    Session *session = calloc(1, sizeof(Session));
+    if (session == NULL) {
+        printf("ERR\n");
+        exit(1);
+    }
+    session -> fd = fd;
+    session -> files[0] = session -> files[1] = session -> files[2] = -1;
+    Shell *shell = &session -> shell, *base = server -> base;
+    shell -> vars.local = 1; // The exports of a session only go to its own children
+    shell -> spawn = base -> spawn;
+    shell -> path_cache = base -> path_cache;
+    shell -> signal_fd = base -> signal_fd;
+    shell -> pgid = base -> pgid;
+    shell -> pid = base -> pid;
+    shell -> stats = base -> stats;
+    shell -> stats_fd = -1;
+    shell -> async = 1;
+    shell -> history.fd = -1;
+    shell -> on_other_child = server_child;
+    shell -> ctx = server;
+    server -> sessions[fd] = session;
+    struct epoll_event event = {EPOLLIN, {.fd = fd}};
+    epoll_ctl(server -> epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+// A method to end a session whose client is gone, the foreground job of its line gets a SIGHUP
+void session_free(Server *server, Session *session){
+    if (session -> shell.waiting != NULL && !session -> shell.wait_again) { // Not a job of 'wait', it runs in the background
+        job_signal(session -> shell.waiting, SIGHUP);
+    }
+    for (int i = 0; i < 3; i++) {
+        if (session -> files[i] >= 0) {
+            close(session -> files[i]);
+        }
+    }
+    server -> sessions[session -> fd] = NULL;
+    close(session -> fd);
+    free_shell(&session -> shell); // The children that still run are reaped as nobody's
+    free(session);
+}
+
+// A method to reap the children and go on with the lines whose foreground job is done
+void server_reap(Server *server){
+    reap_children(server -> base); // Every child goes through server_child to its session
+    for (int i = 0; i < server -> capacity; i++) {
+        Session *session = server -> sessions[i];
+        if (session != NULL && session -> shell.waiting != NULL && session -> shell.waiting -> running == 0) {
+            session_run(server, session);
+        }
+    }
+}
+
+// A method to serve the clients that connect to a Unix socket, each one gets a session with its own variables
+// and jobs. The lines of the sessions and the SIGCHLDs of their children are multiplexed with epoll, so a
+// foreground job of one session does not hold up the others. Only returns if the socket can not be opened.
+int run_server(Shell *base, const char *path){
+    Server server;
+    memset(&server, 0, sizeof(server));
+    server.base = base;
+    server.environ = environ;
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        printf("The socket path %s is too long\n", path);
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+    unlink(path); // A socket left behind by an earlier server
+    server.listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server.listen_fd < 0 || bind(server.listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(server.listen_fd, SOMAXCONN) < 0) {
+        printf("Error opening the socket %s\n", path);
+        return 1;
+    }
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = {EPOLLIN, {.fd = server.listen_fd}};
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &event);
+    event.data.fd = base -> signal_fd;
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, base -> signal_fd, &event);
+    for (int i = 0; i < 3; i++) {
+        server.std_fds[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+    }
+    signal(SIGPIPE, SIG_IGN); // A client that went away must not kill the server, the children get it back
+    base -> on_other_child = server_child;
+    base -> ctx = &server;
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(server.epoll_fd, events, SERVER_MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == server.listen_fd) {
+                int client;
+                while ((client = accept4(server.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    session_add(&server, client);
+                }
+            } else if (fd == base -> signal_fd) {
+                server_reap(&server);
+            } else if (fd < server.capacity && server.sessions[fd] != NULL) { // The session may be gone already
+                Session *session = server.sessions[fd];
+                if (session -> files[0] >= 0 && !session -> more) { // A line runs, so this is a hang up
+                    session_free(&server, session);
+                } else if (session_read(&server, session) < 0) {
+                    session_free(&server, session);
+                }
+            }
+        }
+    }
+}
+
+// The keys of the line editor that are not a single byte
+enum edit_key{
+    EDIT_KEY_DELETE = 256 // 'ESC [ 3 ~'
+};
+
+// What a key does to the line that is edited
+enum edit_result{
+    EDIT_MORE, // The line goes on
+    EDIT_LINE, // Enter, the line is done
+    EDIT_END // The end of the input
+};
+
+// The line editor of an interactive shell. The terminal is in raw mode only while a line is edited, the commands
+// run with the settings it had before.
+typedef struct line_editor{
+    struct termios cooked; // The settings of the terminal outside of the editor
+    int timer_fd; // Fires when the held back notices of the jobs are due
+    int notice_due; // Set while the timer runs
+    char *line; // The line, null terminated
+    size_t length;
+    size_t capacity; // The room for chars, not counting the null terminator
+    size_t cursor; // The byte the cursor is on
+    size_t scroll; // The first byte on the screen, a line wider than the terminal scrolls with the cursor
+    int escape; // How far into an escape sequence the input is: 0 none, 1 after ESC, 2 after 'ESC [' or 'ESC O'
+    int escape_arg; // The number of an 'ESC [ n ~'
+    char *typed; // The line as it was before Up, the history is searched for the lines that start with it
+    size_t typed_length;
+    long *shown; // The lines of the history Up went through, Down goes back through them
+    size_t shown_count;
+    size_t shown_capacity;
+    char prompt[PROMPT_SIZE];
+    int columns; // The width of the terminal
+    char redraw[EDIT_REDRAW_SIZE]; // Everything a redraw writes, so it takes one write
+}LineEditor;
+
+// A method to start the line editor, returns -1 if it can not be used and the lines are read as they are
+int editor_init(LineEditor *editor){
+    memset(editor, 0, sizeof(*editor));
+    editor -> capacity = 256;
+    editor -> line = malloc(editor -> capacity + 1);
+    if (editor -> line == NULL) {
+        printf("ERR\n");
+        exit(1);
+    }
+    editor -> timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    return editor -> timer_fd < 0 ? -1 : 0;
+}
+
+// A method to release the line editor
+void editor_free(LineEditor *editor){
+    if (editor -> timer_fd >= 0) {
+        close(editor -> timer_fd);
+    }
+    free(editor -> line);
+    free(editor -> typed);
+    free(editor -> shown);
+}
+
+// A method to count the columns text takes on the screen, the continuation bytes of UTF-8 take none
+size_t text_columns(const char *text, size_t length){
+    size_t columns = 0;
+    for (size_t i = 0; i < length; i++) {
+        columns += ((unsigned char)text[i] & 0xc0) != 0x80;
+    }
+    return columns;
+}
+
+// A method to find the start of the char after the one at i, the bytes of a UTF-8 char are moved over together
+size_t editor_next(LineEditor *editor, size_t i){
+    if (i < editor -> length) {
+        i++;
+        while (i < editor -> length && ((unsigned char)editor -> line[i] & 0xc0) == 0x80) {
+            i++;
+        }
+    }
+    return i;
+}
+
+// A method to find the start of the char before the one at i
+size_t editor_prev(LineEditor *editor, size_t i){
+    if (i > 0) {
+        i--;
+        while (i > 0 && ((unsigned char)editor -> line[i] & 0xc0) == 0x80) {
+            i--;
+        }
+    }
+    return i;
+}
+
+// A method to get the width of the terminal, a very wide one is used up to EDIT_MAX_COLUMNS
+void editor_size(LineEditor *editor){
+    struct winsize size;
+    editor -> columns = ioctl(STDIN_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 ? size.ws_col : 80;
+    if (editor -> columns < 16) {
+        editor -> columns = 16;
+    } else if (editor -> columns > EDIT_MAX_COLUMNS) {
+        editor -> columns = EDIT_MAX_COLUMNS;
+    }
+}
+
+// A method to add text to the redraw, the buffer is sized so a prompt line always fits
+void redraw_put(LineEditor *editor, size_t *n, const char *text, size_t length){
+    if (*n + length > sizeof(editor -> redraw)) {
+        length = sizeof(editor -> redraw) - *n;
+    }
+    memcpy(editor -> redraw + *n, text, length);
+    *n += length;
+}
+
+// A method to redraw the prompt line with one write: the prompt, the part of the line that fits in the terminal
+// and the cursor. The part scrolls to keep the cursor in it, so a redraw is never longer than a row of the
+// terminal, whatever the length of the line.
+void editor_refresh(LineEditor *editor){
+    size_t columns = editor -> columns;
+    const char *prompt = editor -> prompt;
+    size_t prompt_columns = text_columns(prompt, strlen(prompt));
+    while (prompt_columns > columns / 2 || ((unsigned char)*prompt & 0xc0) == 0x80) { // A long prompt loses its start
+        prompt_columns -= ((unsigned char)*prompt++ & 0xc0) != 0x80;
+    }
+    size_t room = columns - prompt_columns - 1; // The last column is kept for the cursor
+    if (editor -> cursor < editor -> scroll) {
+        editor -> scroll = editor -> cursor;
+    }
+    size_t before = text_columns(editor -> line + editor -> scroll, editor -> cursor - editor -> scroll);
+    while (before >= room) {
+        editor -> scroll = editor_next(editor, editor -> scroll);
+        before--;
+    }
+    size_t end = editor -> scroll;
+    for (size_t shown = 0; end < editor -> length && shown < room; shown++) {
+        end = editor_next(editor, end);
+    }
+    size_t n = 0;
+    redraw_put(editor, &n, "\r", 1);
+    redraw_put(editor, &n, prompt, strlen(prompt));
+    redraw_put(editor, &n, editor -> line + editor -> scroll, end - editor -> scroll);
+    char move[48];
+    int move_length = snprintf(move, sizeof(move), "\x1b[K\r\x1b[%zuC", prompt_columns + before);
+    redraw_put(editor, &n, move, move_length);
+    fflush(stdout);
+    write_all(STDOUT_FILENO, editor -> redraw, n);
+}
+
+// A method to replace the chars from 'from' to 'to' with text, the cursor ends up after the text
+void editor_replace(LineEditor *editor, size_t from, size_t to, const char *text, size_t length){
+    if (editor -> length - (to - from) + length > editor -> capacity) {
+        while (editor -> length - (to - from) + length > editor -> capacity) {
+            editor -> capacity *= 2;
+        }
+        editor -> line = realloc(editor -> line, editor -> capacity + 1);
+        if (editor -> line == NULL) {
+            printf("ERR\n");
+            exit(1);
+        }
+    }
+    memmove(editor -> line + from + length, editor -> line + to, editor -> length - to + 1); // With the terminator
+    memcpy(editor -> line + from, text, length);
+    editor -> length += length - (to - from);
+    editor -> cursor = from + length;
+}
+
+// A method to show the next older line of the history that starts with the typed line. Lines that look just
+// like the one shown are skipped, so a command that was run many times takes one Up.
+void editor_history_up(Shell *shell, LineEditor *editor){
+    History *history = &shell -> history;
+    history_index(history); // The lines of the file are only counted once it is indexed
+    if (editor -> shown_count == 0) { // Keeping the typed line, Down brings it back
+        free(editor -> typed);
+        editor -> typed = malloc(editor -> length + 1);
+        if (editor -> typed == NULL) {
+            printf("ERR\n");
+            exit(1);
+        }
+        memcpy(editor -> typed, editor -> line, editor -> length + 1);
+        editor -> typed_length = editor -> length;
+    }
+    long i = editor -> shown_count > 0 ? editor -> shown[editor -> shown_count - 1] : (long)history -> count;
+    do {
+        i = history_find(history, editor -> typed, editor -> typed_length, i);
+    } while (i >= 0 && history -> lines[i].length == editor -> length &&
+             memcmp(history -> lines[i].text, editor -> line, editor -> length) == 0);
+    if (i < 0) {
+        return;
+    }
+    if (editor -> shown_count == editor -> shown_capacity) {
+        editor -> shown_capacity = editor -> shown_capacity == 0 ? 16 : editor -> shown_capacity * 2;
+        editor -> shown = realloc(editor -> shown, editor -> shown_capacity * sizeof(long));
+        if (editor -> shown == NULL) {
+            printf("ERR\n");
+            exit(1);
+        }
+    }
+    editor -> shown[editor -> shown_count++] = i;
+    editor_replace(editor, 0, editor -> length, history -> lines[i].text, history -> lines[i].length);
+}
+
+// A method to go back to the newer line that was shown before the last Up, or to the typed line
+void editor_history_down(Shell *shell, LineEditor *editor){
+    if (editor -> shown_count == 0) {
+        return;
+    }
+    editor -> shown_count--;
+    if (editor -> shown_count == 0) {
+        editor_replace(editor, 0, editor -> length, editor -> typed, editor -> typed_length);
+        return;
+    }
+    HistoryLine *line = &shell -> history.lines[editor -> shown[editor -> shown_count - 1]];
+    editor_replace(editor, 0, editor -> length, line -> text, line -> length);
+}
+
+// A method to handle a key: the chars are inserted, ctrl a/e/b/f and the arrows move the cursor, backspace,
+// delete, ctrl k/u/w delete, Up and Down (or ctrl p/n) go through the history, ctrl l clears the screen and
+// ctrl d ends the input on an empty line
+int editor_key(Shell *shell, LineEditor *editor, int key){
+    size_t cursor = editor -> cursor;
+    if (key != 0x10 && key != 0x0e) { // Any other key makes the line shown the typed one
+        editor -> shown_count = 0;
+    }
+    switch (key) {
+        case '\n':
+        case '\r':
+            editor -> cursor = editor -> length;
+            return EDIT_LINE;
+        case 0x04: // ctrl d
+            if (editor -> length == 0) {
+                return EDIT_END;
+            } // Fall through
+        case EDIT_KEY_DELETE:
+            editor_replace(editor, cursor, editor_next(editor, cursor), "", 0);
+            break;
+        case 0x7f: // Backspace
+        case 0x08:
+            editor_replace(editor, editor_prev(editor, cursor), cursor, "", 0);
+            break;
+        case 0x01: // ctrl a, Home
+            editor -> cursor = 0;
+            break;
+        case 0x05: // ctrl e, End
+            editor -> cursor = editor -> length;
+            break;
+        case 0x02: // ctrl b, Left
+            editor -> cursor = editor_prev(editor, cursor);
+            break;
+        case 0x06: // ctrl f, Right
+            editor -> cursor = editor_next(editor, cursor);
+            break;
+        case 0x0b: // ctrl k, deleting to the end of the line
+            editor_replace(editor, cursor, editor -> length, "", 0);
+            break;
+        case 0x15: // ctrl u, deleting to the start of the line
+            editor_replace(editor, 0, cursor, "", 0);
+            break;
+        case 0x17: { // ctrl w, deleting the word before the cursor
+            size_t start = cursor;
+            while (start > 0 && editor -> line[start - 1] == ' ') {
+                start--;
+            }
+            while (start > 0 && editor -> line[start - 1] != ' ') {
+                start--;
+            }
+            editor_replace(editor, start, cursor, "", 0);
+            break;
+        }
+        case 0x0c: // ctrl l
+            write_all(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+            break;
+        case 0x10: // ctrl p, Up
+            editor_history_up(shell, editor);
+            break;
+        case 0x0e: // ctrl n, Down
+            editor_history_down(shell, editor);
+            break;
+        default:
+            if (key >= ' ' && key < 256) {
+                char c = key;
+                editor_replace(editor, cursor, cursor, &c, 1);
+            }
+    }
+    return EDIT_MORE;
+}
+
+// A method to handle a byte of input, the escape sequences of the arrows, Home, End and Delete are turned into
+// the keys they stand for
+int editor_input(Shell *shell, LineEditor *editor, unsigned char c){
+    if (editor -> escape == 1) {
+        editor -> escape = c == '[' || c == 'O' ? 2 : 0;
+        editor -> escape_arg = 0;
+        return EDIT_MORE;
+    }
+    if (editor -> escape == 2) {
+        if (isdigit(c) || c == ';') { // 'ESC [ 1 ; 5 C' is ctrl Right, the modifier is left out
+            editor -> escape_arg = c == ';' ? 0 : editor -> escape_arg * 10 + c - '0';
+            return EDIT_MORE;
+        }
+        editor -> escape = 0;
+        int arg = editor -> escape_arg;
+        const char *keys = "A\x10" "B\x0e" "C\x06" "D\x02" "H\x01" "F\x05";
+        for (const char *key = keys; *key != '\0'; key += 2) {
+            if (c == key[0]) {
+                return editor_key(shell, editor, key[1]);
+            }
+        }
+        if (c == '~' && (arg == 1 || arg == 7 || arg == 4 || arg == 8 || arg == 3)) {
+            return editor_key(shell, editor, arg == 3 ? EDIT_KEY_DELETE : arg == 1 || arg == 7 ? 0x01 : 0x05);
+        }
+        return EDIT_MORE;
+    }
+    if (c == 0x1b) {
+        editor -> escape = 1;
+        return EDIT_MORE;
+    }
+    return editor_key(shell, editor, c);
+}
+
+// A method to handle the signals that came while a line is edited: SIGCHLD reaps the children and starts the
+// timer of the notices, SIGINT (ctrl c) drops the line, SIGWINCH takes the new width and SIGTSTP is ignored, the
+// shell never stops itself. Returns 1 if the prompt line must be redrawn.
+int editor_signals(Shell *shell, LineEditor *editor){
+    struct signalfd_siginfo info;
+    int children = 0, redraw = 0;
+    while (read(shell -> signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGCHLD) { // Several SIGCHLDs can be merged into one
+            children = 1;
+        } else if (info.ssi_signo == SIGINT) {
+            editor -> cursor = editor -> length;
+            editor_refresh(editor);
+            write_all(STDOUT_FILENO, "^C\n", 3);
+            editor -> length = editor -> cursor = editor -> scroll = editor -> shown_count = 0;
+            editor -> line[0] = '\0';
+            shell -> last_status = 128 + SIGINT;
+            redraw = 1;
+        } else if (info.ssi_signo == SIGWINCH) {
+            editor_size(editor);
+            redraw = 1;
+        }
+    }
+    if (children) {
+        collect_children(shell);
+        for (int i = 0; i < shell -> job_count && !editor -> notice_due; i++) {
+            if (job_reportable(shell -> jobs[i])) { // Holding the notice back, more jobs may be about to finish
+                struct itimerspec due = {{0, 0}, {0, EDIT_NOTICE_DELAY_NS}};
+                timerfd_settime(editor -> timer_fd, 0, &due, NULL);
+                editor -> notice_due = 1;
+            }
+        }
+    }
+    return redraw;
+}
+
+// A method to print the notices of the jobs that finished above the prompt line once the timer is due, so a
+// burst of jobs that finish together costs one redraw. Returns 1 if the prompt line must be redrawn.
+int editor_notices(Shell *shell, LineEditor *editor){
+    uint64_t expirations;
+    if (read(editor -> timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return 0;
+    }
+    editor -> notice_due = 0;
+    printf("\r\x1b[K");
+    report_jobs(shell, 1);
+    return 1;
+}
+
+// A method to read a line from the terminal with the line editor. It waits on the terminal, the signalfd and
+// the timer of the notices at once: the keys that came in together are handled before one redraw, the children
+// are reaped as soon as they change and the jobs that finished are reported above the prompt line without
+// losing what was typed. Returns the line, valid until the next call, or NULL at the end of the input.
+char *edit_line(Shell *shell, LineEditor *editor, LineReader *reader){
+    if (tcgetattr(STDIN_FILENO, &editor -> cooked) < 0) { // Taken again every time, a command may have changed it
+        print_prompt(shell -> command_count, shell -> arg_count);
+        return read_line(reader);
+    }
+    struct termios raw = editor -> cooked;
+    raw.c_lflag &= ~(ICANON | ECHO | IEXTEN); // ISIG stays, ctrl c and ctrl z come through the signalfd
+    raw.c_iflag &= ~IXON;
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    prompt_text(editor -> prompt, sizeof(editor -> prompt), shell -> command_count, shell -> arg_count);
+    editor_size(editor);
+    editor -> length = editor -> cursor = editor -> scroll = editor -> shown_count = 0;
+    editor -> line[0] = '\0';
+    editor -> escape = 0;
+    editor_refresh(editor);
+    int result = EDIT_MORE;
+    while (result == EDIT_MORE) {
+        int redraw = 0;
+        if (reader -> start == reader -> end) { // The keys typed ahead are used before waiting for more
+            struct pollfd fds[3] = {{reader -> fd, POLLIN, 0}, {shell -> signal_fd, POLLIN, 0},
+                                    {editor -> timer_fd, POLLIN, 0}};
+            if (poll(fds, 3, -1) < 0) {
+                continue;
+            }
+            if (fds[1].revents & POLLIN) {
+                redraw |= editor_signals(shell, editor);
+            }
+            if (fds[2].revents & POLLIN) {
+                redraw |= editor_notices(shell, editor);
+            }
+            if (fds[0].revents != 0) {
+                reader -> start = reader -> scanned = reader -> end = 0;
+                ssize_t n = read(reader -> fd, reader -> buf, reader -> size - 1);
+                if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) {
+                    reader -> eof = 1;
+                    result = EDIT_END;
+                } else if (n > 0) {
+                    reader -> end = n;
+                }
+            }
+        }
+        while (result == EDIT_MORE && reader -> start < reader -> end) { // What comes after Enter stays for later
+            result = editor_input(shell, editor, reader -> buf[reader -> start++]);
+            redraw = 1;
+        }
+        reader -> scanned = reader -> start;
+        if (redraw) {
+            editor_refresh(editor);
+        }
+    }
+    if (editor -> notice_due) { // The prompt reports the jobs before the next line
+        struct itimerspec off = {{0, 0}, {0, 0}};
+        timerfd_settime(editor -> timer_fd, 0, &off, NULL);
+        editor -> notice_due = 0;
+    }
+    write_all(STDOUT_FILENO, "\n", 1);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &editor -> cooked);
+    return result == EDIT_LINE ? editor -> line : NULL;
+}
+
+int main(int argc, char *argv[]) {
+    Shell shell;
+    memset(&shell, 0, sizeof(shell));
+    shell.spawn = SPAWN_POSIX;
+    shell.stats_fd = -1;
+    shell.path_cache = &shell.own_path_cache;
+    shell.history.fd = -1;
+    const char *script = NULL; // The file of commands to run, NULL to read stdin
+    const char *server_path = NULL; // The socket of '--server'
+    for (int i = 1; i < argc; i++) { // Reading the startup options
+        if (strncmp(argv[i], "--spawn=", 8) == 0 && parse_spawn_strategy(argv[i] + 8) >= 0) {
+            shell.spawn = parse_spawn_strategy(argv[i] + 8);
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            shell.stats = 1;
+        } else if (strncmp(argv[i], "--stats-log=", 12) == 0) {
+            if (stats_open_log(&shell, argv[i] + 12) != 0) {
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            server_path = argv[++i];
+        } else if (argv[i][0] != '-' && script == NULL) {
+            script = argv[i];
+        } else {
+            printf("Usage: %s [--spawn=posix|vfork|fork] [--stats] [--stats-log=file] [--server socket] [script]\n", argv[0]);
+            return 1;
+        }
+    }
+    int input_fd = STDIN_FILENO;
+    if (script != NULL) {
+        input_fd = open(script, O_RDONLY | O_CLOEXEC);
+        if (input_fd < 0) {
+            printf("Error opening the script %s\n", script);
+            return 1;
+        }
+    }
+    // A script or input that is not a terminal is run without the prompt and without job control
+    int interactive = script == NULL && server_path == NULL && isatty(STDIN_FILENO);
+    shell.interactive = interactive;
+    LineReader reader;
+    reader_init(&reader, input_fd);
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    long line_count = 0;
+
+    // SIGCHLD is only read from a signalfd, the children are reaped from the main loop while it waits for input.
+    // A terminal also sends ctrl c, ctrl z and its new size there, the line editor handles them between the keys.
+    sigset_t child_set;
+    sigemptyset(&child_set);
+    sigaddset(&child_set, SIGCHLD);
+    if (interactive) {
+        sigaddset(&child_set, SIGINT);
+        sigaddset(&child_set, SIGTSTP);
+        sigaddset(&child_set, SIGWINCH);
+    }
+    sigprocmask(SIG_BLOCK, &child_set, NULL);
+    shell.signal_fd = signalfd(-1, &child_set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (shell.signal_fd < 0) {
+        printf("Error creating the signalfd\n");
+        return 1;
+    }
+    reader.wake_fd = shell.signal_fd;
+    reader.on_wake = reap_callback;
+    reader.ctx = &shell;
+    if (interactive) { // Job control: the shell gets its own process group and gives the terminal to the foreground job
+        while (tcgetpgrp(STDIN_FILENO) != getpgrp()) { // Waiting until we are in the foreground
+            kill(-getpgrp(), SIGTTIN);
+        }
+        signal(SIGINT, SIG_IGN); // ctrl c and ctrl z go to the job that has the terminal
+        signal(SIGQUIT, SIG_IGN);
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+        setpgid(0, 0);
+        tcsetpgrp(STDIN_FILENO, getpid());
+        const char *path = getenv("HISTFILE"), *home = getenv("HOME");
+        char default_path[4096];
+        if (path == NULL && home != NULL) {
+            snprintf(default_path, sizeof(default_path), "%s/.shell_history", home);
+            path = default_path;
+        }
+        if (path != NULL) {
+            history_open(&shell.history, path);
+        }
+    }
+    shell.pgid = getpgrp();
+    shell.pid = getpid();
+    if (server_path != NULL) { // The lines come from the clients of the socket
+        int status = run_server(&shell, server_path);
+        free_shell(&shell);
+        close(shell.signal_fd);
+        free(reader.buf);
+        return status;
+    }
+    int exit_count = 0; // An exit counter
+    LineEditor editor;
+    int editing = interactive && editor_init(&editor) == 0; // Without a timerfd the lines are read as they are
+
+    while (1) {
+        if (shell.job_count > 0) { // A script may not wait for input for a long time, so reaping here too
+            reap_children(&shell);
+            report_jobs(&shell, interactive); // Only a terminal is told about the jobs that finished
+        }
+        if (interactive && !editing) {
+            print_prompt(shell.command_count, shell.arg_count);
+        }
+        char *line = editing ? edit_line(&shell, &editor, &reader) : read_line(&reader); // The line entered by the user
+        if (line == NULL) { // The end of the input
+            break;
+        }
+        line_count++;
+
+        // Checking if the user has pressed enter three times, a script just skips its empty lines
+        if (line[0] == '\0') {
+            if (!interactive) {
+                continue;
+            }
+            exit_count++;
+            if (exit_count >= 3) {
+                break;
+            }
+            continue;
+        } else {
+            exit_count = 0;
+        }
+
+        if (shell.history.fd >= 0) { // The lines of a terminal go to the history, after their '!'s are expanded
+            line = history_expand(&shell, line);
+            if (line == NULL) {
+                arena_reset(&shell.arena);
+                continue;
+            }
+            history_add(&shell.history, line);
+        }
+        CommandLine *cmd_line = shell_parse(&shell, line);
+        if (cmd_line != NULL && read_heredocs(&shell.arena, cmd_line, &reader, interactive) < 0) {
+            cmd_line = NULL; // The input ended inside a here-document
+        }
+        if (cmd_line == NULL) {
+            printf("Syntax error\n");
+        } else {
+            for (int i = 0; i < cmd_line -> count; i++) {
+                run_pipeline(&shell, &cmd_line -> pipelines[i]);
+            }
+        }
+        arena_reset(&shell.arena); // Releasing everything the line used
+    }
+    if (!interactive) { // Reporting the throughput of the script
+        struct timespec end_time;
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        double seconds = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+        fflush(stdout);
+        dprintf(STDERR_FILENO, "%ld lines, %d commands in %.3f s (%.0f commands/sec)\n",
+                line_count, shell.command_count, seconds, seconds > 0 ? shell.command_count / seconds : 0.0);
+    }
+    if (interactive) {
+        editor_free(&editor);
+    }
+    free_shell(&shell); // Freeing the memory
+    stats_open_log(&shell, NULL);
+    close(shell.signal_fd);
+    free(reader.buf);
+    if (input_fd != STDIN_FILENO) {
+        close(input_fd);
+    }
+    return 0;
+}
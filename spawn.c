@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "spawn.h"
+
+#define SPAWN_STACK_SIZE (256 * 1024) // The stack of the vfork child, it only has to get to execvp
+#define IOPRIO_WHO_PROCESS 1
+
+extern char **environ;
+
+static const char *strategy_names[] = {"posix", "vfork", "fork"};
+
+// The signals the shell ignores or blocks that every child gets back with their default action
+static const int reset_signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGPIPE, SIGCHLD};
+#define RESET_SIGNAL_COUNT (int)(sizeof(reset_signals) / sizeof(reset_signals[0]))
+
+// A method to get a strategy from its name, returns -1 if the name is unknown
+int parse_spawn_strategy(const char *name){
+    for (int i = 0; i < (int)(sizeof(strategy_names) / sizeof(strategy_names[0])); i++) {
+        if (strcmp(name, strategy_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// A method to get the name of a strategy
+const char *spawn_strategy_name(SpawnStrategy strategy){
+    return strategy_names[strategy];
+}
+
+// A method to execute the command of the spec, it only returns if the exec failed
+static void exec_spec(const SpawnSpec *spec){
+    if (spec -> path != NULL) {
+        execv(spec -> path, spec -> argv);
+    } else {
+        execvp(spec -> argv[0], spec -> argv);
+    }
+}
+
+// A method to apply the scheduling of a spec to the calling child, a setting the kernel refuses is left as it was
+static void apply_sched(const SpawnSched *sched){
+    if (sched -> has_cpus) {
+        sched_setaffinity(0, sizeof(sched -> cpus), &sched -> cpus);
+    }
+    if (sched -> has_nice) {
+        setpriority(PRIO_PROCESS, 0, sched -> nice);
+    }
+    if (sched -> ioprio >= 0) {
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, sched -> ioprio);
+    }
+}
+
+// A method to prepare a child that was forked by the caller: it joins its process group, takes the
+// terminal, gets the default signal actions and the scheduling of the spec, just like the children of spawn_process
+void spawn_child_setup(const SpawnSpec *spec){
+    if (spec -> pgid >= 0) {
+        setpgid(0, spec -> pgid);
+        if (spec -> tty_fd >= 0) { // Done before SIGTTOU is back to its default, or it would stop us
+            tcsetpgrp(spec -> tty_fd, getpgrp());
+        }
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    for (int i = 0; i < RESET_SIGNAL_COUNT; i++) {
+        sigaction(reset_signals[i], &action, NULL);
+    }
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+    if (spec -> sched != NULL) {
+        apply_sched(spec -> sched);
+    }
+}
+
+// A method to move the fds of the spec into place in a fork or vfork child
+static void setup_child_fds(const SpawnSpec *spec){
+    if (spec -> in_fd != STDIN_FILENO) {
+        dup2(spec -> in_fd, STDIN_FILENO);
+    }
+    if (spec -> out_fd != STDOUT_FILENO) {
+        dup2(spec -> out_fd, STDOUT_FILENO);
+    }
+    if (spec -> err_fd != STDERR_FILENO) {
+        dup2(spec -> err_fd, STDERR_FILENO);
+    }
+}
+
+// posix_spawn applies the dup2s through file actions and reports a failed exec to us
+static pid_t spawn_posix(const SpawnSpec *spec){
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t defaults, empty;
+    sigemptyset(&defaults);
+    for (int i = 0; i < RESET_SIGNAL_COUNT; i++) {
+        sigaddset(&defaults, reset_signals[i]);
+    }
+    sigemptyset(&empty);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, &empty);
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    if (spec -> pgid >= 0) {
+        posix_spawnattr_setpgroup(&attr, spec -> pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+#ifdef POSIX_SPAWN_TCSETPGROUP
+        if (spec -> tty_fd >= 0) { // Giving the terminal in the child, so it can not read it before it is its own
+            posix_spawnattr_tcsetpgrp_np(&attr, spec -> tty_fd);
+            flags |= POSIX_SPAWN_TCSETPGROUP;
+        }
+#endif
+    }
+    posix_spawnattr_setflags(&attr, flags);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (spec -> in_fd != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, spec -> in_fd, STDIN_FILENO);
+    }
+    if (spec -> out_fd != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, spec -> out_fd, STDOUT_FILENO);
+    }
+    if (spec -> err_fd != STDERR_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, spec -> err_fd, STDERR_FILENO);
+    }
+    pid_t pid;
+    int error;
+    if (spec -> path != NULL) {
+        error = posix_spawn(&pid, spec -> path, &actions, &attr, spec -> argv, environ);
+    } else {
+        error = posix_spawnp(&pid, spec -> argv[0], &actions, &attr, spec -> argv, environ);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return pid;
+}
+
+// The state shared with the vfork child, the parent is suspended until the child execs or exits
+typedef struct vfork_child{
+    const SpawnSpec *spec;
+    volatile int error; // The errno of a failed exec
+}VforkChild;
+
+static int vfork_child_main(void *arg){
+    VforkChild *child = arg;
+    // The shell takes its signals through a signalfd and installs no handlers, so resetting the signals it
+    // ignores before the mask is cleared is enough, no handler can run on the memory we share
+    spawn_child_setup(child -> spec);
+    setup_child_fds(child -> spec);
+    exec_spec(child -> spec);
+    child -> error = errno;
+    _exit(127);
+}
+
+// clone with CLONE_VM | CLONE_VFORK skips copying the page tables, so the cost does not grow with the heap
+static pid_t spawn_vfork(const SpawnSpec *spec){
+    static char *stack = NULL;
+    if (stack == NULL) {
+        stack = mmap(NULL, SPAWN_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (stack == MAP_FAILED) {
+            stack = NULL;
+            return -1;
+        }
+    }
+    sigset_t all, old;
+    sigfillset(&all);
+    sigprocmask(SIG_SETMASK, &all, &old); // No handler may run in the child before it resets them
+    VforkChild child = {spec, 0};
+    pid_t pid = clone(vfork_child_main, stack + SPAWN_STACK_SIZE, CLONE_VM | CLONE_VFORK | SIGCHLD, &child);
+    int saved_errno = errno;
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    if (pid < 0) {
+        errno = saved_errno;
+        return -1;
+    }
+    if (child.error != 0) { // The exec failed, the child is already gone
+        waitpid(pid, NULL, 0);
+        errno = child.error;
+        return -1;
+    }
+    return pid;
+}
+
+// The plain fork fallback, a close-on-exec pipe tells us if the exec failed
+static pid_t spawn_fork(const SpawnSpec *spec){
+    int error_pipe[2];
+    if (pipe2(error_pipe, O_CLOEXEC) == -1) {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(error_pipe[0]);
+        spawn_child_setup(spec);
+        setup_child_fds(spec);
+        exec_spec(spec);
+        int error = errno;
+        ssize_t written = write(error_pipe[1], &error, sizeof(error)); // If this fails the parent just sees a child that exited
+        (void)written;
+        _exit(127);
+    }
+    close(error_pipe[1]);
+    if (pid < 0) {
+        close(error_pipe[0]);
+        return -1;
+    }
+    int error;
+    ssize_t n;
+    while ((n = read(error_pipe[0], &error, sizeof(error))) < 0 && errno == EINTR);
+    close(error_pipe[0]);
+    if (n == sizeof(error)) { // The pipe was written before it closed, so the exec failed
+        waitpid(pid, NULL, 0);
+        errno = error;
+        return -1;
+    }
+    return pid;
+}
+
+// A method to start a child, returns its pid or -1 with errno set if it could not be started or executed
+pid_t spawn_process(SpawnStrategy strategy, const SpawnSpec *spec){
+    if (strategy == SPAWN_POSIX && spec -> sched != NULL) { // The child has to set its scheduling itself
+        strategy = SPAWN_VFORK;
+    }
+    switch (strategy) {
+        case SPAWN_VFORK:
+            return spawn_vfork(spec);
+        case SPAWN_FORK:
+            return spawn_fork(spec);
+        default:
+            return spawn_posix(spec);
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef SPAWN_H
+#define SPAWN_H
+
+#include <sched.h>
+#include <sys/types.h>
+
+// The ways the shell can start a child process
+typedef enum spawn_strategy{
+    SPAWN_POSIX, // posix_spawn, the default
+    SPAWN_VFORK, // clone(CLONE_VM | CLONE_VFORK) followed by execvp
+    SPAWN_FORK // fork followed by execvp
+}SpawnStrategy;
+
+#define SPAWN_IOPRIO(class, level) (((class) << 13) | (level)) // An I/O priority as ioprio_set takes it
+
+// How a child is scheduled, it is applied in the child right before the exec
+typedef struct spawn_sched{
+    cpu_set_t cpus; // The CPUs the child may run on
+    int has_cpus; // Set when the child gets cpus instead of the affinity of the shell
+    int nice; // The nice level of the child
+    int has_nice; // Set when the child gets nice instead of the nice level of the shell
+    int ioprio; // The I/O priority of the child, -1 keeps the one of the shell
+}SpawnSched;
+
+// What the child should look like, the fds are dup2'ed onto STDIN/STDOUT/STDERR when they differ from them
+typedef struct spawn_spec{
+    char *const *argv; // The command and its arguments, NULL terminated
+    const char *path; // The resolved path of the command, NULL to search PATH for argv[0]
+    int in_fd; // The fd the child reads from
+    int out_fd; // The fd the child writes to
+    int err_fd; // The fd the child writes its errors to
+    pid_t pgid; // -1 keeps the process group of the shell, 0 starts a new group, otherwise the group to join
+    int tty_fd; // When it is not -1, the group of the child is made the foreground group of this terminal
+    const SpawnSched *sched; // NULL keeps the scheduling of the shell
+}SpawnSpec;
+
+// A method to get a strategy from its name, returns -1 if the name is unknown
+int parse_spawn_strategy(const char *name);
+
+// A method to get the name of a strategy
+const char *spawn_strategy_name(SpawnStrategy strategy);
+
+// A method to prepare a child that was forked by the caller: it joins its process group, takes the
+// terminal, gets the default signal actions and the scheduling of the spec, just like the children of spawn_process
+void spawn_child_setup(const SpawnSpec *spec);
+
+// A method to start a child, returns its pid or -1 with errno set if it could not be started or executed.
+// Every fd the child should not inherit must be opened with O_CLOEXEC. The child starts with no blocked
+// signals and with the job control signals back to their default action. posix_spawn can not set the
+// scheduling of a child, so a spec with a sched is started with the vfork strategy instead.
+pid_t spawn_process(SpawnStrategy strategy, const SpawnSpec *spec);
+
+#endif